@@ -23,18 +23,18 @@ blocking_sock_connection(int sockfd) {
     while (1) {
         uint8_t buf[1024];
 
-        printf("calling recv...\n");
+        log_info("calling recv...");
 
         int len = recv(sockfd_new, buf, sizeof buf, 0);
 
         if (len == -1) {
-            fprintf(stderr, "%s:%d: error calling recv", __FILE__, __LINE__);
+            log_error("%s:%d: error calling recv", __FILE__, __LINE__);
         } else if (len == 0) {
-            printf("peer disconnected, i'm done\n");
+            log_info("peer disconnected, i'm done");
             break;
         }
 
-        printf("recv returned %d bytes\n", len);
+        log_info("recv returned %d bytes", len);
     }
 
     close(sockfd_new);
@@ -0,0 +1,47 @@
+#!/bin/sh
+# NOTE: runs the same load scenarios against every server mode so they can be compared side by side
+#
+# usage: bench.sh [port] [seconds]
+#   MODES="epoll libuv" bench.sh     only benchmark some modes
+
+PORT=${1:-8081}
+DURATION=${2:-10}
+MODES=${MODES:-"sequential thread thread_pool select poll epoll epoll_et epoll_reactor epoll_acceptor uring libuv libuv_reactor coro"}
+SERVER=${SERVER:-./build/server}
+LOADGEN=${LOADGEN:-./build/loadgen}
+OUTPUT=${OUTPUT:-bench_output}
+
+# NOTE: "<label>:<loadgen args>"
+SCENARIOS="
+closed_c1:-c 1 -t 1 -s 64
+closed_c64:-c 64 -t 4 -s 64
+closed_c64_large:-c 64 -t 4 -s 900
+open_c64_10k:-c 64 -t 4 -s 64 -r 10000
+"
+
+mkdir -p "$OUTPUT"
+
+for mode in $MODES; do
+    echo "=== $mode"
+
+    echo "$SCENARIOS" | while IFS=: read -r label args; do
+        [ -z "$label" ] && continue
+
+        # NOTE: a fresh server per scenario, so a mode that crashed on a previous scenario does not hide the next one
+        $SERVER -m "$mode" -n "$(nproc)" "$PORT" > /dev/null 2>&1 &
+        server_pid=$!
+
+        sleep 0.5
+
+        echo "--- $label"
+        # shellcheck disable=SC2086
+        timeout $((DURATION + 10)) $LOADGEN -p "$PORT" -d "$DURATION" -o "$OUTPUT/$mode-$label.hgrm" $args
+
+        if ! kill -0 "$server_pid" 2>/dev/null; then
+            echo "server exited during the scenario"
+        fi
+
+        kill "$server_pid" 2>/dev/null
+        wait "$server_pid" 2>/dev/null
+    done
+done
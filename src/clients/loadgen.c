@@ -0,0 +1,626 @@
+// NOTE: load generator for the '*' / '^...$' protocol. Every thread drives a slice of the connections from its own
+// epoll loop, a request is '^' + payload + '$' and its response is the payload transformed, so the response length is
+// known up-front and requests can be pipelined. With -f the connections pick the framed protocol instead, a request is
+// a 4 bytes big-endian length + payload and its response has the same length.
+//
+// closed-loop (default): each connection sends the next request as soon as the previous response arrives, measuring
+// the max throughput of the server.
+//
+// open-loop (-r rate): requests are issued on a fixed schedule whatever the server is doing, and the latency is
+// measured from the time the request was supposed to be sent, so a stalled server is charged for every request it
+// delayed (coordinated omission correction). A request due while its connection already has MAX_PIPELINE in flight is
+// dropped and recorded with the delay it had when dropped, so the percentiles still see it (a lower bound)
+//
+// the rates are taken over the measured time of the run, from the first request to the end of the grace period
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../headers/error.h"
+#include "../headers/histogram.h"
+
+#define MAX_PIPELINE 1024
+#define SEND_BATCH 64
+
+typedef struct {
+    const char* host;
+    int port;
+    int nconns;
+    int nthreads;
+    int duration;
+    int payload;
+    bool framed;
+    double rate;
+    const char* hgrm_path;
+} loadgen_config_t;
+
+typedef struct {
+    int fd;
+    bool acked;
+    bool want_out;
+    // NOTE: the server closed or reset the connection, it's off the epoll queue and out of the schedule
+    bool dead;
+    // NOTE: requests queued but not fully written yet, send_off is how much of the first one is already on the socket
+    int unsent;
+    int send_off;
+    // NOTE: fifo of the intended start time of each request waiting for its response
+    uint64_t starts[MAX_PIPELINE];
+    int head;
+    int inflight;
+    int recv_progress;
+    uint64_t next_due;
+} conn_t;
+
+typedef struct {
+    int id;
+    const loadgen_config_t* config;
+    conn_t* conns;
+    int nconns;
+    int first_conn;
+    uint8_t* batch;
+    int request_len;
+    int response_len;
+    histogram_t latency;
+    uint64_t requests;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t connected;
+    uint64_t dropped;
+    uint64_t errors;
+    // NOTE: wall time from the start of the schedule to the last response of the grace period
+    uint64_t elapsed_ns;
+    pthread_t thread;
+} loadgen_worker_t;
+
+uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+conn_set_out(int epollfd, conn_t* conn, bool want_out) {
+    if (conn->want_out == want_out) {
+        return;
+    }
+
+    struct epoll_event event = {0};
+
+    event.data.ptr = conn;
+    event.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    conn->want_out = want_out;
+}
+
+// NOTE: the socket stays open until the end of the run, only the queue stops watching it
+void
+conn_kill(loadgen_worker_t* worker, int epollfd, conn_t* conn) {
+    if (conn->dead) {
+        return;
+    }
+
+    worker->errors++;
+    conn->dead = true;
+    conn->unsent = 0;
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->fd, NULL) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+}
+
+bool
+conn_enqueue(loadgen_worker_t* worker, conn_t* conn, uint64_t start, uint64_t now) {
+    if (conn->inflight == MAX_PIPELINE) {
+        worker->dropped++;
+
+        histogram_record(&worker->latency, now - start);
+
+        return false;
+    }
+
+    conn->starts[(conn->head + conn->inflight) % MAX_PIPELINE] = start;
+    conn->inflight++;
+    conn->unsent++;
+
+    return true;
+}
+
+// NOTE: the batch buffer holds SEND_BATCH back to back requests, so up to SEND_BATCH queued requests go on one send
+void
+conn_flush(loadgen_worker_t* worker, int epollfd, conn_t* conn) {
+    while (conn->unsent > 0) {
+        int batch = conn->unsent < SEND_BATCH ? conn->unsent : SEND_BATCH;
+        int len = batch * worker->request_len - conn->send_off;
+        int sent_len = send(conn->fd, worker->batch + conn->send_off, len, MSG_NOSIGNAL);
+
+        if (sent_len == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_set_out(epollfd, conn, true);
+
+                return;
+            }
+
+            conn_kill(worker, epollfd, conn);
+
+            return;
+        }
+
+        worker->bytes_out += sent_len;
+
+        int consumed = conn->send_off + sent_len;
+
+        conn->unsent -= consumed / worker->request_len;
+        conn->send_off = consumed % worker->request_len;
+    }
+
+    conn_set_out(epollfd, conn, false);
+}
+
+void
+conn_on_readable(loadgen_worker_t* worker, int epollfd, conn_t* conn, bool closed_loop, bool running) {
+    uint8_t buf[64 * 1024];
+
+    while (1) {
+        int len = recv(conn->fd, buf, sizeof(buf), 0);
+
+        if (len == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_kill(worker, epollfd, conn);
+            }
+
+            return;
+        } else if (len == 0) {
+            conn_kill(worker, epollfd, conn);
+
+            return;
+        }
+
+        uint64_t now = now_ns();
+        int offset = 0;
+
+        worker->bytes_in += len;
+
+        if (!conn->acked) {
+            if (buf[0] != '*') {
+                errlog("expected '*' from the server, got '%c'", buf[0]);
+            }
+
+            conn->acked = true;
+            worker->connected++;
+            offset = 1;
+
+            if (closed_loop && running) {
+                conn_enqueue(worker, conn, now, now);
+            }
+        }
+
+        while (offset < len) {
+            if (conn->inflight == 0) {
+                // NOTE: the server answered more than it was asked
+                worker->errors++;
+
+                break;
+            }
+
+            int needed = worker->response_len - conn->recv_progress;
+            int taken = len - offset < needed ? len - offset : needed;
+
+            offset += taken;
+            conn->recv_progress += taken;
+
+            if (conn->recv_progress == worker->response_len) {
+                histogram_record(&worker->latency, now - conn->starts[conn->head]);
+
+                conn->head = (conn->head + 1) % MAX_PIPELINE;
+                conn->inflight--;
+                conn->recv_progress = 0;
+                worker->requests++;
+
+                if (closed_loop && running) {
+                    conn_enqueue(worker, conn, now, now);
+                }
+            }
+        }
+    }
+}
+
+int
+connect_peer(const loadgen_config_t* config) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (sockfd == -1) {
+        errlog("error to create socket");
+    }
+
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config->port);
+
+    if (inet_pton(AF_INET, config->host, &addr.sin_addr) != 1) {
+        errlog("invalid host address '%s'", config->host);
+    }
+
+    if (connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        errlog("error to connect to %s:%d", config->host, config->port);
+    }
+
+    int opt = 1;
+
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    // NOTE: the handshake byte waits on the socket until the server sent its '*'
+    if (config->framed && send(sockfd, "#", 1, MSG_NOSIGNAL) != 1) {
+        errlog("error to send the framing handshake");
+    }
+
+    int flags = fcntl(sockfd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        errlog("error to set nonblocking mode on socket connection");
+    }
+
+    return sockfd;
+}
+
+void*
+start_loadgen_worker(void* arg) {
+    loadgen_worker_t* worker = (loadgen_worker_t*) arg;
+    const loadgen_config_t* config = worker->config;
+
+    bool closed_loop = config->rate <= 0;
+    // NOTE: on open-loop every connection issues its share of the total rate
+    uint64_t interval = closed_loop ? 0 : (uint64_t) (config->nconns * 1e9 / config->rate);
+
+    int epollfd = epoll_create1(0);
+
+    if (epollfd == -1) {
+        errlog("error to create epoll queue");
+    }
+
+    for (int i = 0; i < worker->nconns; i++) {
+        conn_t* conn = &worker->conns[i];
+
+        memset(conn, 0, sizeof(*conn));
+
+        conn->fd = connect_peer(config);
+
+        struct epoll_event event = {0};
+
+        event.data.ptr = conn;
+        event.events = EPOLLIN;
+
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+            errlog("error on epoll queue manipulation");
+        }
+    }
+
+    struct epoll_event events[256];
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t) config->duration * 1000000000ull;
+
+    for (int i = 0; i < worker->nconns; i++) {
+        // NOTE: spread the schedule of the connections along the interval
+        worker->conns[i].next_due = start + interval * (worker->first_conn + i) / config->nconns;
+    }
+
+    uint64_t now = start;
+
+    while (now < end) {
+        uint64_t wake = end;
+
+        if (!closed_loop) {
+            for (int i = 0; i < worker->nconns; i++) {
+                if (worker->conns[i].acked && !worker->conns[i].dead && worker->conns[i].next_due < wake) {
+                    wake = worker->conns[i].next_due;
+                }
+            }
+        }
+
+        int timeout = wake > now ? (int) ((wake - now) / 1000000) : 0;
+
+        if (timeout > 100) {
+            timeout = 100;
+        }
+
+        int ready_len = epoll_wait(epollfd, events, 256, timeout);
+
+        if (ready_len == -1 && errno != EINTR) {
+            errlog("error on epoll wait");
+        }
+
+        for (int i = 0; i < ready_len; i++) {
+            conn_t* conn = (conn_t*) events[i].data.ptr;
+
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                conn_on_readable(worker, epollfd, conn, closed_loop, true);
+            }
+
+            if (conn->unsent > 0) {
+                conn_flush(worker, epollfd, conn);
+            }
+        }
+
+        now = now_ns();
+
+        if (!closed_loop) {
+            for (int i = 0; i < worker->nconns; i++) {
+                conn_t* conn = &worker->conns[i];
+
+                if (!conn->acked || conn->dead) {
+                    continue;
+                }
+
+                while (conn->next_due <= now && conn->next_due < end) {
+                    conn_enqueue(worker, conn, conn->next_due, now);
+                    conn->next_due += interval;
+                }
+
+                if (conn->unsent > 0 && !conn->want_out) {
+                    conn_flush(worker, epollfd, conn);
+                }
+            }
+        }
+    }
+
+    // NOTE: give the requests already sent a grace period to be answered, closing a socket with unread data resets the
+    // connection on the server side
+    uint64_t grace_end = now + 1000000000ull;
+    int pending = 1;
+
+    while (pending > 0 && now < grace_end) {
+        pending = 0;
+
+        for (int i = 0; i < worker->nconns; i++) {
+            pending += worker->conns[i].acked && !worker->conns[i].dead ? worker->conns[i].inflight : 0;
+        }
+
+        int ready_len = epoll_wait(epollfd, events, 256, 10);
+
+        for (int i = 0; i < ready_len; i++) {
+            conn_t* conn = (conn_t*) events[i].data.ptr;
+
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                conn_on_readable(worker, epollfd, conn, closed_loop, false);
+            }
+
+            if (conn->unsent > 0) {
+                conn_flush(worker, epollfd, conn);
+            }
+        }
+
+        now = now_ns();
+    }
+
+    worker->elapsed_ns = now - start;
+
+    for (int i = 0; i < worker->nconns; i++) {
+        shutdown(worker->conns[i].fd, SHUT_WR);
+        close(worker->conns[i].fd);
+    }
+
+    close(epollfd);
+
+    return 0;
+}
+
+void
+usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-s payload] [-f] [-r rate] "
+            "[-o file.hgrm]\n",
+            program);
+    fprintf(stderr, "  -f       length-prefixed frames instead of '^...$' messages\n");
+    fprintf(stderr, "  -r rate  open-loop with a fixed total of requests per second (default: closed-loop)\n");
+    fprintf(stderr, "  -o file  write the latency percentile distribution (HdrHistogram format, in us)\n");
+
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char** argv) {
+    loadgen_config_t config = {
+        .host = "127.0.0.1",
+        .port = 8081,
+        .nconns = 16,
+        .nthreads = 2,
+        .duration = 10,
+        .payload = 64,
+        .framed = false,
+        .rate = 0,
+        .hgrm_path = NULL,
+    };
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:s:fr:o:")) != -1) {
+        switch (opt) {
+            case 'h':
+                config.host = optarg;
+                break;
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            case 'c':
+                config.nconns = atoi(optarg);
+                break;
+            case 't':
+                config.nthreads = atoi(optarg);
+                break;
+            case 'd':
+                config.duration = atoi(optarg);
+                break;
+            case 's':
+                config.payload = atoi(optarg);
+                break;
+            case 'f':
+                config.framed = true;
+                break;
+            case 'r':
+                config.rate = atof(optarg);
+                break;
+            case 'o':
+                config.hgrm_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (config.nconns <= 0 || config.nthreads <= 0 || config.duration <= 0 || config.payload <= 0) {
+        usage(argv[0]);
+    }
+
+    if (config.nthreads > config.nconns) {
+        config.nthreads = config.nconns;
+    }
+
+    // NOTE: '^' + payload + '$', the payload avoids '$' and ends far from "WXY" that stops the libuv server. A frame is
+    // the header + payload and is answered with a frame as long
+    int request_len = config.framed ? config.payload + 4 : config.payload + 2;
+    int response_len = config.framed ? request_len : config.payload;
+    uint8_t* batch = (uint8_t*) malloc((size_t) request_len * SEND_BATCH);
+
+    if (batch == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    for (int i = 0; i < SEND_BATCH; i++) {
+        uint8_t* request = &batch[i * request_len];
+        uint8_t* payload = config.framed ? &request[4] : &request[1];
+
+        if (config.framed) {
+            uint32_t header = htonl(config.payload);
+
+            memcpy(request, &header, sizeof(header));
+        } else {
+            request[0] = '^';
+            request[request_len - 1] = '$';
+        }
+
+        for (int j = 0; j < config.payload; j++) {
+            payload[j] = 'a' + j % 20;
+        }
+    }
+
+    loadgen_worker_t* workers = (loadgen_worker_t*) calloc(config.nthreads, sizeof(loadgen_worker_t));
+    conn_t* conns = (conn_t*) calloc(config.nconns, sizeof(conn_t));
+
+    if (workers == NULL || conns == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    int first_conn = 0;
+
+    for (int i = 0; i < config.nthreads; i++) {
+        loadgen_worker_t* worker = &workers[i];
+
+        worker->id = i;
+        worker->config = &config;
+        worker->batch = batch;
+        worker->request_len = request_len;
+        worker->response_len = response_len;
+        worker->first_conn = first_conn;
+        worker->nconns = config.nconns / config.nthreads + (i < config.nconns % config.nthreads ? 1 : 0);
+        worker->conns = &conns[first_conn];
+
+        histogram_init(&worker->latency);
+
+        first_conn += worker->nconns;
+
+        if (pthread_create(&worker->thread, NULL, start_loadgen_worker, worker) != 0) {
+            errlog("error to create load generator thread %d", i);
+        }
+    }
+
+    histogram_t latency;
+    uint64_t requests = 0, bytes_in = 0, bytes_out = 0, connected = 0, dropped = 0, errors = 0, elapsed_ns = 0;
+
+    histogram_init(&latency);
+
+    for (int i = 0; i < config.nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        histogram_merge(&latency, &workers[i].latency);
+
+        requests += workers[i].requests;
+        bytes_in += workers[i].bytes_in;
+        bytes_out += workers[i].bytes_out;
+        connected += workers[i].connected;
+        dropped += workers[i].dropped;
+        errors += workers[i].errors;
+
+        if (workers[i].elapsed_ns > elapsed_ns) {
+            elapsed_ns = workers[i].elapsed_ns;
+        }
+    }
+
+    double seconds = elapsed_ns / 1e9;
+
+    if (config.rate > 0) {
+        printf("open-loop at %.0f req/s", config.rate);
+    } else {
+        printf("closed-loop");
+    }
+
+    printf(", %d connections (%lu acked), %d threads, %ds (measured %.2fs), payload %d bytes%s\n",
+           config.nconns,
+           connected,
+           config.nthreads,
+           config.duration,
+           seconds,
+           config.payload,
+           config.framed ? " framed" : "");
+    printf("requests: %lu, %.1f req/s, in %.2f MB/s, out %.2f MB/s, errors %lu\n",
+           requests,
+           requests / seconds,
+           bytes_in / seconds / 1e6,
+           bytes_out / seconds / 1e6,
+           errors);
+    printf("latency (us): p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f, dropped %lu\n",
+           histogram_percentile(&latency, 50.0) / 1e3,
+           histogram_percentile(&latency, 99.0) / 1e3,
+           histogram_percentile(&latency, 99.9) / 1e3,
+           latency.max / 1e3,
+           dropped);
+
+    if (config.hgrm_path != NULL) {
+        FILE* out = fopen(config.hgrm_path, "w");
+
+        if (out == NULL) {
+            errlog("error to open '%s'", config.hgrm_path);
+        }
+
+        histogram_print(&latency, out, 1e3);
+        fclose(out);
+    }
+
+    free(conns);
+    free(workers);
+    free(batch);
+
+    return 0;
+}
@@ -0,0 +1,258 @@
+// NOTE: turns a trace dump of the server (-T path, kill -USR2) into a Chrome trace, to be opened on chrome://tracing or
+// ui.perfetto.dev. Every ring becomes a thread with an instant per event, and every request becomes a span from the
+// first bytes received to the send that drained the output they produced
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../headers/error.h"
+#include "../headers/trace.h"
+
+// NOTE: output of a peer not sent yet and the span open since its first bytes arrived
+typedef struct {
+    uint64_t key;
+    uint64_t outstanding;
+    uint64_t span_start;
+    bool span_open;
+    bool used;
+} peer_span_t;
+
+typedef struct {
+    peer_span_t* slots;
+    size_t cap;
+    size_t len;
+} span_table_t;
+
+void
+span_table_init(span_table_t* table, size_t cap) {
+    table->slots = (peer_span_t*) calloc(cap, sizeof(peer_span_t));
+    table->cap = cap;
+    table->len = 0;
+
+    if (table->slots == NULL) {
+        errlog("error to allocate memory");
+    }
+}
+
+// NOTE: open addressing, the table doubles before it's half full
+peer_span_t*
+span_table_get(span_table_t* table, uint64_t key) {
+    if (table->len * 2 >= table->cap) {
+        span_table_t grown;
+
+        span_table_init(&grown, table->cap * 2);
+
+        for (size_t i = 0; i < table->cap; i++) {
+            if (table->slots[i].used) {
+                *span_table_get(&grown, table->slots[i].key) = table->slots[i];
+            }
+        }
+
+        free(table->slots);
+
+        *table = grown;
+    }
+
+    size_t i = (key * 0x9e3779b97f4a7c15ull) & (table->cap - 1);
+
+    while (table->slots[i].used && table->slots[i].key != key) {
+        i = (i + 1) & (table->cap - 1);
+    }
+
+    if (!table->slots[i].used) {
+        table->slots[i].used = true;
+        table->slots[i].key = key;
+        table->len++;
+    }
+
+    return &table->slots[i];
+}
+
+const char*
+trace_event_name(trace_event_type_t type) {
+    switch (type) {
+        case TRACE_ACCEPT:
+            return "accept";
+        case TRACE_RECV:
+            return "recv";
+        case TRACE_STATE:
+            return "state";
+        case TRACE_SEND_QUEUED:
+            return "send_queued";
+        case TRACE_SEND_DONE:
+            return "send_done";
+        case TRACE_CLOSE:
+            return "close";
+    }
+
+    return "unknown";
+}
+
+const char*
+trace_event_arg_name(trace_event_type_t type) {
+    switch (type) {
+        case TRACE_ACCEPT:
+        case TRACE_CLOSE:
+            return "fd";
+        case TRACE_STATE:
+            return "state";
+        default:
+            return "bytes";
+    }
+}
+
+void
+emit_event(FILE* out, bool* first, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+void
+emit_event(FILE* out, bool* first, const char* fmt, ...) {
+    va_list args;
+
+    fprintf(out, "%s\n", *first ? "" : ",");
+
+    va_start(args, fmt);
+    vfprintf(out, fmt, args);
+    va_end(args);
+
+    *first = false;
+}
+
+// NOTE: the span of a request is opened by the first bytes received while the peer had nothing to send and closed by
+// the send that drains the output, a chunk that produced no output closes it right away
+void
+track_span(FILE* out, bool* first, span_table_t* spans, uint32_t tid, const trace_event_t* event) {
+    trace_event_type_t type = trace_event_type(event);
+    uint32_t arg = trace_event_arg(event);
+    peer_span_t* span = span_table_get(spans, ((uint64_t) tid << 32) | event->peer);
+    bool close_span = false;
+
+    if (type == TRACE_ACCEPT || type == TRACE_CLOSE) {
+        span->outstanding = 0;
+        span->span_open = false;
+    } else if (type == TRACE_RECV) {
+        if (!span->span_open) {
+            span->span_open = true;
+            span->span_start = event->ts;
+        }
+    } else if (type == TRACE_SEND_QUEUED) {
+        span->outstanding += arg;
+        close_span = span->outstanding == 0;
+    } else if (type == TRACE_SEND_DONE) {
+        span->outstanding = span->outstanding > arg ? span->outstanding - arg : 0;
+        close_span = span->outstanding == 0;
+    }
+
+    if (close_span && span->span_open) {
+        emit_event(out,
+                   first,
+                   "{\"name\":\"request\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"args\":{\"peer\":%u}}",
+                   tid,
+                   span->span_start / 1000.0,
+                   (event->ts - span->span_start) / 1000.0,
+                   event->peer);
+
+        span->span_open = false;
+    }
+}
+
+void
+usage(const char* program) {
+    fprintf(stderr, "usage: %s trace.dump [trace.json]\n", program);
+    fprintf(stderr, "  converts a dump of the server trace rings (-T path, kill -USR2) into a Chrome trace\n");
+
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        usage(argv[0]);
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+
+    if (in == NULL) {
+        errlog("error to open %s", argv[1]);
+    }
+
+    FILE* out = argc == 3 ? fopen(argv[2], "w") : stdout;
+
+    if (out == NULL) {
+        errlog("error to open %s", argv[2]);
+    }
+
+    trace_dump_header_t header;
+
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != TRACE_MAGIC) {
+        errlog("%s isn't a trace dump", argv[1]);
+    }
+
+    span_table_t spans;
+
+    span_table_init(&spans, 1024);
+
+    bool first = true;
+    uint64_t nevents = 0;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (uint32_t i = 0; i < header.nrings; i++) {
+        trace_dump_ring_t ring;
+
+        if (fread(&ring, sizeof(ring), 1, in) != 1) {
+            errlog("truncated trace dump");
+        }
+
+        ring.name[TRACE_NAME_SIZE - 1] = '\0';
+
+        emit_event(out,
+                   &first,
+                   "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                   ring.id,
+                   ring.name,
+                   ring.id);
+
+        for (uint32_t k = 0; k < ring.nevents; k++) {
+            trace_event_t event;
+
+            if (fread(&event, sizeof(event), 1, in) != 1) {
+                errlog("truncated trace dump");
+            }
+
+            trace_event_type_t type = trace_event_type(&event);
+
+            emit_event(out,
+                       &first,
+                       "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                       "\"args\":{\"peer\":%u,\"%s\":%u}}",
+                       trace_event_name(type),
+                       ring.id,
+                       event.ts / 1000.0,
+                       event.peer,
+                       trace_event_arg_name(type),
+                       trace_event_arg(&event));
+
+            track_span(out, &first, &spans, ring.id, &event);
+
+            nevents++;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+
+    fprintf(stderr, "%u threads, %lu events\n", header.nrings, nevents);
+
+    free(spans.slots);
+    fclose(in);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+// NOTE: M:N green threads. Every scheduler thread has its own SO_REUSEPORT listening socket and epoll queue, and runs
+// each of its peers on a coroutine of its own: start_state_machine, the same blocking code of the thread per
+// connection server, parks on EAGAIN instead of blocking the thread, so a handful of threads serve as many peers as
+// the coroutine stacks fit in memory
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#include "headers/coro.h"
+#include "headers/error.h"
+#include "headers/servers.h"
+#include "headers/stats.h"
+
+#define CORO_MAX_EVENTS 1024
+
+typedef struct {
+    int id;
+    int port;
+} coro_thread_config_t;
+
+void*
+start_coroutine_scheduler(void* arg) {
+    coro_thread_config_t* config = (coro_thread_config_t*) arg;
+
+    int sockfd = listen_inet_socket(config->port, true);
+
+    printf("coroutine scheduler %d listening on socket %d\n", config->id, sockfd);
+
+    make_sock_nonblocking(sockfd);
+
+    stats_register("coro");
+
+    coro_scheduler_t scheduler;
+
+    coro_scheduler_init(&scheduler, start_state_machine);
+
+    // NOTE: level-triggered, with a data.ptr no coroutine has. A batch that didn't drain the backlog is reported again
+    struct epoll_event accept_event = {0};
+
+    accept_event.data.ptr = NULL;
+    accept_event.events = EPOLLIN;
+
+    if (epoll_ctl(scheduler.epollfd, EPOLL_CTL_ADD, sockfd, &accept_event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    struct epoll_event* events = (struct epoll_event*) calloc(CORO_MAX_EVENTS, sizeof(struct epoll_event));
+    accepted_peer_t peers[ACCEPT_BUDGET];
+
+    if (events == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    while (1) {
+        // NOTE: don't sleep while coroutines that yielded on their budget are waiting to run
+        int nready = epoll_wait(scheduler.epollfd, events, CORO_MAX_EVENTS, scheduler.run_head != NULL ? 0 : -1);
+
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            errlog("error on epoll_wait");
+        }
+
+        uint64_t started_ns = stats_clock_ns();
+
+        stats_add(&stats_current->syscalls, 1);
+        stats_hist_add(&stats_current->events_per_wait, nready);
+
+        for (int i = 0; i < nready; i++) {
+            if (events[i].data.ptr == NULL) {
+                bool drained;
+                int naccepted = accept_peers(sockfd, peers, ACCEPT_BUDGET, &drained);
+
+                for (int k = 0; k < naccepted; k++) {
+                    coro_spawn(&scheduler, peers[k].sockfd);
+                }
+
+                // NOTE: the EPOLL_CTL_ADD of every peer
+                stats_add(&stats_current->syscalls, naccepted);
+            } else {
+                coro_on_ready(&scheduler, (coro_t*) events[i].data.ptr, events[i].events);
+            }
+        }
+
+        coro_run(&scheduler);
+
+        stats_loop_iteration(started_ns);
+    }
+
+    return 0;
+}
+
+void
+coroutine_server(int port, int nthreads) {
+    if (nthreads <= 0) {
+        errlog("coroutine server needs at least one scheduler thread, got %d", nthreads);
+    }
+
+    pthread_t* threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+    coro_thread_config_t* configs = (coro_thread_config_t*) calloc(nthreads, sizeof(coro_thread_config_t));
+
+    if (threads == NULL || configs == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        configs[i].id = i;
+        configs[i].port = port;
+
+        if (pthread_create(&threads[i], NULL, start_coroutine_scheduler, &configs[i]) != 0) {
+            errlog("error to create coroutine scheduler %d", i);
+        }
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(configs);
+    free(threads);
+}
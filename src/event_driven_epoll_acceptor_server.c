@@ -0,0 +1,173 @@
+// NOTE: one acceptor thread and N epoll worker threads. The acceptor is the only one on the listening socket, it takes
+// the connections off the backlog and hands every one to a worker through the worker inbox, a single-producer
+// single-consumer ring with an eventfd wakeup. A connection storm only keeps the acceptor busy, the workers take at
+// most ACCEPT_BUDGET new peers per loop iteration and keep serving the connected ones meanwhile. Unlike SO_REUSEPORT
+// (see event_driven_epoll_reactor_server.c) the server picks the worker of every connection: the least loaded one (the
+// fewest peers handed over and not closed yet) or round-robin
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "headers/error.h"
+#include "headers/servers.h"
+
+// NOTE: peers handed over and not taken by the worker yet, a full inbox sends the peer to the next worker
+#define ACCEPTOR_INBOX_SIZE 4096
+
+typedef enum { ACCEPTOR_LEAST_LOADED, ACCEPTOR_ROUND_ROBIN } acceptor_policy_t;
+
+typedef struct {
+    peer_inbox_t inbox;
+    int id;
+    // NOTE: acceptor only, the peers handed over to the worker so far
+    uint64_t assigned;
+} acceptor_worker_t;
+
+static acceptor_policy_t acceptor_policy = ACCEPTOR_LEAST_LOADED;
+
+// NOTE: least or rr
+bool
+acceptor_parse_policy(const char* name, acceptor_policy_t* policy) {
+    if (strcmp(name, "least") == 0) {
+        *policy = ACCEPTOR_LEAST_LOADED;
+    } else if (strcmp(name, "rr") == 0) {
+        *policy = ACCEPTOR_ROUND_ROBIN;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void*
+start_acceptor_worker(void* arg) {
+    acceptor_worker_t* worker = (acceptor_worker_t*) arg;
+
+    printf("worker %d waiting on inbox %d\n", worker->id, worker->inbox.eventfd);
+
+    epoll_event_loop(-1, peer_table_create(), false, &worker->inbox);
+
+    return 0;
+}
+
+// NOTE: the peers a worker is serving or still has on its inbox. The closes are read from the stats block of the worker
+// as it goes, at worst a few closes behind
+uint64_t
+acceptor_worker_load(acceptor_worker_t* worker) {
+    thread_stats_t* stats = __atomic_load_n(&worker->inbox.stats, __ATOMIC_ACQUIRE);
+
+    return worker->assigned - (stats != NULL ? __atomic_load_n(&stats->closes, __ATOMIC_RELAXED) : 0);
+}
+
+// NOTE: the worker the policy picks, the scan starts at the next worker so the ties are spread too
+int
+acceptor_pick_worker(acceptor_worker_t* workers, int nworkers, int* next) {
+    int picked = *next;
+
+    *next = (*next + 1) % nworkers;
+
+    if (acceptor_policy == ACCEPTOR_ROUND_ROBIN) {
+        return picked;
+    }
+
+    uint64_t picked_load = acceptor_worker_load(&workers[picked]);
+
+    for (int k = 1; k < nworkers && picked_load > 0; k++) {
+        int i = (*next + k - 1) % nworkers;
+        uint64_t load = acceptor_worker_load(&workers[i]);
+
+        if (load < picked_load) {
+            picked = i;
+            picked_load = load;
+        }
+    }
+
+    return picked;
+}
+
+// NOTE: a full inbox means its worker is far behind, the peer goes to the next one. It's only refused when every inbox
+// is full
+void
+acceptor_hand_over(acceptor_worker_t* workers, int nworkers, int* next, const accepted_peer_t* peer) {
+    int picked = acceptor_pick_worker(workers, nworkers, next);
+
+    for (int k = 0; k < nworkers; k++) {
+        acceptor_worker_t* worker = &workers[(picked + k) % nworkers];
+
+        if (peer_inbox_push(&worker->inbox, peer)) {
+            worker->assigned++;
+
+            return;
+        }
+    }
+
+    log_warn("every worker inbox is full, closing socket %d", peer->sockfd);
+    close(peer->sockfd);
+}
+
+void
+event_driven_epoll_acceptor_server(int sockfd, int nworkers) {
+    if (nworkers <= 0) {
+        errlog("epoll acceptor server needs at least one worker, got %d", nworkers);
+    }
+
+    make_sock_nonblocking(sockfd);
+
+    acceptor_worker_t* workers;
+
+    if (posix_memalign((void**) &workers, 64, nworkers * sizeof(acceptor_worker_t)) != 0) {
+        errlog("error to allocate memory");
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t thread;
+
+        workers[i].id = i;
+        workers[i].assigned = 0;
+
+        peer_inbox_init(&workers[i].inbox, ACCEPTOR_INBOX_SIZE);
+
+        if (pthread_create(&thread, NULL, start_acceptor_worker, &workers[i]) != 0) {
+            errlog("error to create worker %d", i);
+        }
+
+        pthread_detach(thread);
+    }
+
+    stats_register("acceptor");
+
+    int next = 0;
+
+    while (1) {
+        struct pollfd listener = {.fd = sockfd, .events = POLLIN};
+
+        stats_add(&stats_current->syscalls, 1);
+
+        if (poll(&listener, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            errlog("error on poll get ready state");
+        }
+
+        uint64_t started_ns = stats_clock_ns();
+
+        accepted_peer_t peers[ACCEPT_BUDGET];
+        bool drained;
+
+        int accepted = accept_peers(sockfd, peers, ACCEPT_BUDGET, &drained);
+
+        stats_hist_add(&stats_current->events_per_wait, accepted);
+
+        for (int i = 0; i < accepted; i++) {
+            acceptor_hand_over(workers, nworkers, &next, &peers[i]);
+        }
+
+        stats_loop_iteration(started_ns);
+    }
+}
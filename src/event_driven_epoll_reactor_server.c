@@ -0,0 +1,57 @@
+// NOTE: one epoll event loop per thread. Every reactor has its own SO_REUSEPORT listening socket, epoll queue and
+// peer table, so the kernel spreads the accepts between them and nothing is shared on the hot path
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "headers/error.h"
+#include "headers/servers.h"
+
+typedef struct {
+    int id;
+    int port;
+} reactor_config_t;
+
+void*
+start_reactor(void* arg) {
+    reactor_config_t* config = (reactor_config_t*) arg;
+
+    int sockfd = listen_inet_socket(config->port, true);
+
+    printf("reactor %d listening on socket %d\n", config->id, sockfd);
+
+    epoll_event_loop(sockfd, peer_table_create(), false, NULL);
+
+    return 0;
+}
+
+void
+event_driven_epoll_reactor_server(int port, int nreactors) {
+    if (nreactors <= 0) {
+        errlog("epoll reactor server needs at least one reactor, got %d", nreactors);
+    }
+
+    pthread_t* reactors = (pthread_t*) calloc(nreactors, sizeof(pthread_t));
+    reactor_config_t* configs = (reactor_config_t*) calloc(nreactors, sizeof(reactor_config_t));
+
+    if (reactors == NULL || configs == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    for (int i = 0; i < nreactors; i++) {
+        configs[i].id = i;
+        configs[i].port = port;
+
+        if (pthread_create(&reactors[i], NULL, start_reactor, &configs[i]) != 0) {
+            errlog("error to create reactor %d", i);
+        }
+    }
+
+    for (int i = 0; i < nreactors; i++) {
+        pthread_join(reactors[i], NULL);
+    }
+
+    free(configs);
+    free(reactors);
+}
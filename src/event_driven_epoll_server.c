@@ -8,137 +8,379 @@
 #include "headers/error.h"
 #include "headers/servers.h"
 
+// NOTE: ready events handled per epoll_wait call, the ones left are reported on the next call
+#define EPOLL_MAX_EVENTS 1024
+
 void
 event_driven_epoll_server(int sockfd) {
-    make_sock_nonblocking(sockfd);
+    epoll_event_loop(sockfd, peer_table_create(), false, NULL);
+}
 
-    int epollfd = epoll_create1(0);
+// NOTE: edge-triggered mode, a readiness event is only reported once so each peer is drained until EAGAIN on both
+// directions and only asks for EPOLLOUT while its output is blocked
+void
+event_driven_epoll_et_server(int sockfd) {
+    epoll_event_loop(sockfd, peer_table_create(), true, NULL);
+}
 
-    if (epollfd == -1) {
-        errlog("error to create epoll queue");
+uint32_t
+epoll_events_from_status(fd_status_t status) {
+    uint32_t events = 0;
+
+    if (status.want_read) {
+        events |= EPOLLIN;
     }
 
-    struct epoll_event accept_event;
+    if (status.want_write) {
+        events |= EPOLLOUT;
+    }
 
-    accept_event.data.fd = sockfd;
-    accept_event.events = EPOLLIN;
+    return events;
+}
 
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &accept_event) == -1) {
-        errlog("error on epoll queue manipulation");
+// NOTE: the mask registered is cached on the peer, so epoll_ctl is only issued when the interest really changes
+void
+epoll_set_interest(int epollfd, peer_state_t* peer_state, int fd, uint32_t events) {
+    if (peer_state->epoll_events == events) {
+        return;
     }
 
-    struct epoll_event* events = calloc(MAXFDS, sizeof(struct epoll_event));
+    struct epoll_event event = {0};
 
-    if (events == NULL) {
-        errlog("error to alloc memory");
+    event.data.fd = fd;
+    event.events = events;
+
+    stats_add(&stats_current->syscalls, 1);
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        errlog("error on epoll queue maniputation");
     }
 
+    peer_state->epoll_events = events;
+}
+
+void
+epoll_release_peer(int epollfd, peer_table_t* peer_table, int fd) {
+    log_info("socket %d closing", fd);
+
+    on_peer_closed(peer_table, fd);
+
+    stats_add(&stats_current->syscalls, 1);
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        errlog("error on epoll queue maniputation");
+    }
+
+    close(fd);
+}
+
+// NOTE: the kernel may still transmit from the chunks of the zerocopy sends not reported yet and a closed socket
+// doesn't report them anymore, so such a peer is only shut down for writing and left with no interest but its error
+// queue. It's closed once the last notification is read, see the loop
+void
+epoll_close_peer(int epollfd, peer_table_t* peer_table, int fd) {
+    peer_state_t* peer_state = peer_table_get(peer_table, fd);
+
+    if (!send_queue_zerocopy_pending(&peer_state->send_queue)) {
+        epoll_release_peer(epollfd, peer_table, fd);
+
+        return;
+    }
+
+    if (!peer_state->zerocopy_draining) {
+        log_info("socket %d closing once its zerocopy sends complete", fd);
+
+        peer_state->zerocopy_draining = true;
+
+        shutdown(fd, SHUT_WR);
+
+        // NOTE: edge-triggered, the error queue is only reported again when a new notification lands on it
+        epoll_set_interest(epollfd, peer_state, fd, EPOLLET);
+    }
+}
+
+// NOTE: handle the readable and writable sides on the same wakeup, a peer is only sent to when its output is pending
+void
+epoll_on_peer_ready(int epollfd, peer_table_t* peer_table, int fd, uint32_t ready_events) {
+    peer_state_t* peer_state = peer_table_get(peer_table, fd);
+
+    fd_status_t status = {
+        .want_read = peer_state->epoll_events & EPOLLIN,
+        .want_write = peer_state->epoll_events & EPOLLOUT,
+    };
+
+    // NOTE: a peer socket is ready to read
+    if (ready_events & EPOLLIN) {
+        status = on_peer_ready_recv(peer_table, fd);
+
+        if (!status.want_read && !status.want_write) {
+            epoll_close_peer(epollfd, peer_table, fd);
+
+            return;
+        }
+    }
+
+    // NOTE: a peer socket is ready to write
+    if ((ready_events & EPOLLOUT) && status.want_write) {
+        status = on_peer_ready_send(peer_table, fd);
+    }
+
+    if (!status.want_read && !status.want_write) {
+        epoll_close_peer(epollfd, peer_table, fd);
+    } else {
+        epoll_set_interest(epollfd, peer_state, fd, epoll_events_from_status(status));
+    }
+}
+
+// NOTE: returns false when the peer must be closed
+bool
+epoll_drain_peer(peer_table_t* peer_table, int fd) {
+    peer_state_t* peer_state = peer_table_get(peer_table, fd);
+
     while (1) {
-        int ready_len = epoll_wait(epollfd, events, MAXFDS, -1);
+        fd_status_t status = peer_status(peer_state);
 
-        for (int i = 0; i < ready_len; i++) {
-            if (events[i].events & EPOLLERR) {
-                errlog("epoll events contains an error");
+        if (!status.want_read && !status.want_write) {
+            return false;
+        }
+
+        if (status.want_write && peer_state->writable) {
+            if (on_peer_ready_send(peer_table, fd).would_block) {
+                peer_state->writable = false;
+            }
+        } else if (status.want_read && peer_state->readable) {
+            if (on_peer_ready_recv(peer_table, fd).would_block) {
+                peer_state->readable = false;
             }
+        } else {
+            return true;
+        }
+    }
+}
 
-            if (events[i].data.fd == sockfd) {
-                struct sockaddr_in peer_addr;
-                socklen_t peer_addr_len = sizeof(peer_addr);
+uint32_t
+epoll_et_interest(peer_state_t* peer_state) {
+    bool output_blocked = peer_state->send_queue.len > 0 && !peer_state->writable;
 
-                int sockfd_new = accept(sockfd, (struct sockaddr*) &peer_addr, &peer_addr_len);
+    return EPOLLIN | EPOLLET | (output_blocked ? EPOLLOUT : 0);
+}
 
-                if (sockfd_new == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        printf("accept returned EAGAIN or EWOULDBLOCK\n");
-                    } else {
-                        errlog("error to accept socket connection");
-                    }
-                } else {
-                    make_sock_nonblocking(sockfd_new);
+void
+epoll_on_peer_ready_et(int epollfd, peer_table_t* peer_table, int fd, uint32_t ready_events) {
+    peer_state_t* peer_state = peer_table_get(peer_table, fd);
 
-                    if (sockfd_new >= MAXFDS) {
-                        errlog("socket fd (%d) >= MAXFDS (%d)", sockfd_new, MAXFDS);
-                    }
+    if (ready_events & (EPOLLIN | EPOLLHUP)) {
+        peer_state->readable = true;
+    }
 
-                    fd_status_t status = on_peer_connected(sockfd_new, &peer_addr, peer_addr_len);
+    if (ready_events & EPOLLOUT) {
+        peer_state->writable = true;
+    }
 
-                    struct epoll_event event = {0};
+    if (!epoll_drain_peer(peer_table, fd)) {
+        epoll_close_peer(epollfd, peer_table, fd);
+    } else {
+        epoll_set_interest(epollfd, peer_state, fd, epoll_et_interest(peer_state));
+    }
+}
 
-                    event.data.fd = sockfd_new;
+void
+epoll_on_accept(int epollfd, peer_table_t* peer_table, accepted_peer_t* peer, bool edge_triggered) {
+    int sockfd_new = peer->sockfd;
 
-                    if (status.want_read) {
-                        event.events |= EPOLLIN;
-                    }
+    fd_status_t status = on_peer_connected(peer_table, sockfd_new, &peer->addr, peer->addr_len);
+    peer_state_t* peer_state = peer_table_get(peer_table, sockfd_new);
 
-                    if (status.want_write) {
-                        event.events |= EPOLLOUT;
-                    }
+    enable_peer_zerocopy(peer_table, sockfd_new);
 
-                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd_new, &event) == -1) {
-                        errlog("error on epoll queue manipulation");
-                    }
-                }
-            } else {
-                // NOTE: a peer socket is ready to read
-                if (events[i].events & EPOLLIN) {
-                    int fd = events[i].data.fd;
+    struct epoll_event event = {0};
 
-                    fd_status_t status = on_peer_ready_recv(fd);
+    event.data.fd = sockfd_new;
 
-                    struct epoll_event event = {0};
+    if (edge_triggered) {
+        // NOTE: a fresh connection is writable, try to flush the '*' before registering it
+        peer_state->readable = false;
+        peer_state->writable = true;
 
-                    event.data.fd = fd;
+        bool closing = !epoll_drain_peer(peer_table, sockfd_new);
 
-                    if (status.want_read) {
-                        event.events |= EPOLLIN;
-                    }
+        if (closing && !send_queue_zerocopy_pending(&peer_state->send_queue)) {
+            log_info("socket %d closing", sockfd_new);
+            on_peer_closed(peer_table, sockfd_new);
+            close(sockfd_new);
 
-                    if (status.want_write) {
-                        event.events |= EPOLLOUT;
-                    }
+            return;
+        }
+
+        // NOTE: the '*' went out zerocopy, the peer is registered only to wait for its notification
+        event.events = closing ? 0 : epoll_et_interest(peer_state);
+    } else {
+        event.events = epoll_events_from_status(status);
+    }
+
+    stats_add(&stats_current->syscalls, 1);
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd_new, &event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    peer_state->epoll_events = event.events;
+
+    if (event.events == 0) {
+        epoll_close_peer(epollfd, peer_table, sockfd_new);
+    }
+}
+
+// NOTE: accepts at most ACCEPT_BUDGET connections per wakeup so a connection storm can't starve the peers already
+// connected, from the listening socket or from the inbox of an acceptor thread. Returns false when it was drained
+bool
+epoll_accept_peers(int epollfd, peer_table_t* peer_table, int sockfd, peer_inbox_t* inbox, bool edge_triggered) {
+    accepted_peer_t peers[ACCEPT_BUDGET];
+    bool drained;
+
+    int accepted = inbox != NULL ? peer_inbox_take(inbox, peers, ACCEPT_BUDGET, &drained)
+                                 : accept_peers(sockfd, peers, ACCEPT_BUDGET, &drained);
+
+    for (int i = 0; i < accepted; i++) {
+        epoll_on_accept(epollfd, peer_table, &peers[i], edge_triggered);
+    }
+
+    return !drained;
+}
+
+typedef struct {
+    int epollfd;
+    peer_table_t* peer_table;
+} epoll_timer_ctx_t;
+
+void
+epoll_on_peer_timer(timer_entry_t* entry, void* arg) {
+    epoll_timer_ctx_t* ctx = (epoll_timer_ctx_t*) arg;
+    int fd = (int) entry->key;
+
+    peer_state_t* peer_state = peer_table_get(ctx->peer_table, fd);
+
+    if (!peer_timer_fired(ctx->peer_table->timers, peer_state, entry)) {
+        return;
+    }
+
+    log_info("socket %d timed out", fd);
+
+    // NOTE: the zerocopy sends never completed, the connection is reset so the kernel drops the output it was sending
+    // from the chunks
+    if (peer_state->zerocopy_draining) {
+        struct linger linger = {.l_onoff = 1, .l_linger = 0};
+
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+        epoll_release_peer(ctx->epollfd, ctx->peer_table, fd);
+    } else {
+        epoll_close_peer(ctx->epollfd, ctx->peer_table, fd);
+    }
+}
+
+// NOTE: with an inbox the loop doesn't accept itself, it takes the peers an acceptor thread queued for it and watches
+// the inbox eventfd in place of the listening socket
+void
+epoll_event_loop(int sockfd, peer_table_t* peer_table, bool edge_triggered, peer_inbox_t* inbox) {
+    int accept_fd = inbox != NULL ? inbox->eventfd : sockfd;
+
+    if (inbox == NULL) {
+        make_sock_nonblocking(sockfd);
+    }
+
+    int epollfd = epoll_create1(0);
+
+    if (epollfd == -1) {
+        errlog("error to create epoll queue");
+    }
+
+    struct epoll_event accept_event;
+
+    accept_event.data.fd = accept_fd;
+    accept_event.events = EPOLLIN | (edge_triggered ? EPOLLET : 0);
+
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, accept_fd, &accept_event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    struct epoll_event* events = calloc(EPOLL_MAX_EVENTS, sizeof(struct epoll_event));
+
+    if (events == NULL) {
+        errlog("error to alloc memory");
+    }
+
+    if (peer_timeouts_enabled()) {
+        peer_table->timers = timer_wheel_create(timer_wheel_clock());
+    }
 
-                    if (event.events == 0) {
-                        printf("socket %d closing\n", fd);
+    epoll_timer_ctx_t timer_ctx = {.epollfd = epollfd, .peer_table = peer_table};
 
-                        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-                            errlog("error on epoll queue maniputation");
-                        }
+    thread_stats_t* stats = stats_register(edge_triggered ? "epoll_et" : "epoll");
 
-                        close(fd);
-                    } else if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) == -1) {
-                        errlog("error on epoll queue maniputation");
-                    }
-                    // NOTE: a peer socket is ready to write
-                } else if (events[i].events & EPOLLOUT) {
-                    int fd = events[i].data.fd;
+    if (inbox != NULL) {
+        __atomic_store_n(&inbox->stats, stats, __ATOMIC_RELEASE);
+    }
 
-                    fd_status_t status = on_peer_ready_send(fd);
+    // NOTE: edge-triggered or inbox only, the backlog wasn't drained on the last wakeup and won't be reported again
+    bool accept_pending = false;
 
-                    struct epoll_event event = {0};
+    while (1) {
+        // NOTE: the wait only returns earlier than the events when a slot of the timer wheel is due, or right away when
+        // there are connections left on the backlog
+        int timeout = peer_table->timers != NULL ? timer_wheel_timeout_ms(peer_table->timers, timer_wheel_clock()) : -1;
 
-                    event.data.fd = fd;
+        if (accept_pending) {
+            timeout = 0;
+        }
 
-                    if (status.want_read) {
-                        event.events |= EPOLLIN;
-                    }
+        int ready_len = epoll_wait(epollfd, events, EPOLL_MAX_EVENTS, timeout);
+        uint64_t started_ns = stats_clock_ns();
 
-                    if (status.want_write) {
-                        event.events |= EPOLLOUT;
-                    }
+        stats_add(&stats_current->syscalls, 1);
+        stats_hist_add(&stats_current->events_per_wait, ready_len > 0 ? ready_len : 0);
 
-                    if (event.events == 0) {
-                        printf("socket %d closing\n", fd);
+        if (peer_table->timers != NULL) {
+            peer_table->now = timer_wheel_clock();
+        }
+
+        for (int i = 0; i < ready_len; i++) {
+            if (events[i].events & EPOLLERR) {
+                if (events[i].data.fd == accept_fd) {
+                    errlog("epoll events contains an error");
+                }
 
-                        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-                            errlog("error on epoll queue maniputation");
-                        }
+                // NOTE: also where the zerocopy notifications are reported
+                if (!on_peer_ready_error(peer_table, events[i].data.fd)) {
+                    epoll_close_peer(epollfd, peer_table, events[i].data.fd);
 
-                        close(fd);
-                    } else if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) == -1) {
-                        errlog("error on epoll queue maniputation");
-                    }
+                    continue;
                 }
             }
+
+            if (events[i].data.fd == accept_fd) {
+                accept_pending = true;
+            } else if (peer_table_get(peer_table, events[i].data.fd)->zerocopy_draining) {
+                epoll_close_peer(epollfd, peer_table, events[i].data.fd);
+            } else if (edge_triggered) {
+                epoll_on_peer_ready_et(epollfd, peer_table, events[i].data.fd, events[i].events);
+            } else {
+                epoll_on_peer_ready(epollfd, peer_table, events[i].data.fd, events[i].events);
+            }
+        }
+
+        // NOTE: the new peers are accepted after the ready ones were served. On level-triggered mode the listening
+        // socket is reported again while its backlog isn't empty, the inbox eventfd was reset when it was read
+        if (accept_pending) {
+            accept_pending = epoll_accept_peers(epollfd, peer_table, sockfd, inbox, edge_triggered)
+                             && (edge_triggered || inbox != NULL);
+        }
+
+        // NOTE: after the events, a peer closed by its timer could still be on the ready list
+        if (peer_table->timers != NULL) {
+            timer_wheel_advance(peer_table->timers, peer_table->now, epoll_on_peer_timer, &timer_ctx);
         }
+
+        stats_loop_iteration(started_ns);
     }
 }
@@ -1,4 +1,9 @@
+// NOTE: one libuv loop per thread. Every loop has its own SO_REUSEPORT listening socket, allocation pools and peers,
+// so the kernel spreads the accepts between them and nothing is shared on the hot path. The only cross-loop traffic
+// is the stop request, delivered through one async handle per loop
+
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <uv.h>
@@ -6,31 +11,161 @@
 #include "headers/error.h"
 #include "headers/servers.h"
 
-int
-event_driven_libuv_server(int port) {
-    int rc;
-
+typedef struct {
+    int id;
+    int port;
+    bool reuseport;
+    uv_loop_t loop;
     uv_tcp_t server_stream;
+    uv_async_t stop_handle;
+    uv_timer_t timer_handle;
+    uv_loop_ctx_t ctx;
+} uv_worker_t;
 
-    if ((rc = uv_tcp_init(uv_default_loop(), &server_stream)) == -1) {
-        errlog("libuv tcp connection initialization failed: %s", uv_strerror(rc));
+void
+uv_on_stop_requested(uv_async_t* handle) {
+    uv_stop(handle->loop);
+}
+
+// NOTE: every handle left on a stopped loop is a peer, except the handles owned by the worker
+void
+uv_on_walk_close(uv_handle_t* handle, void* arg) {
+    uv_worker_t* worker = (uv_worker_t*) arg;
+
+    if (uv_is_closing(handle)) {
+        return;
+    }
+
+    if (handle == (uv_handle_t*) &worker->server_stream || handle == (uv_handle_t*) &worker->stop_handle
+        || handle == (uv_handle_t*) &worker->timer_handle) {
+        uv_close(handle, NULL);
+    } else {
+        uv_close(handle, uv_on_client_closed);
     }
+}
+
+void*
+start_uv_worker(void* arg) {
+    uv_worker_t* worker = (uv_worker_t*) arg;
 
-    struct sockaddr_in server_address;
+    int rc;
+    int sockfd = listen_inet_socket(worker->port, worker->reuseport);
 
-    if ((rc = uv_ip4_addr("0.0.0.0", port, &server_address)) == -1) {
-        errlog("libuv server address setup failed: %s", uv_strerror(rc));
+    if ((rc = uv_tcp_init(&worker->loop, &worker->server_stream)) < 0) {
+        errlog("libuv tcp connection initialization failed: %s", uv_strerror(rc));
     }
 
-    if ((rc = uv_tcp_bind(&server_stream, (const struct sockaddr*) &server_address, 0)) == -1) {
-        errlog("libuv bind failed: %s", uv_strerror(rc));
+    if ((rc = uv_tcp_open(&worker->server_stream, sockfd)) < 0) {
+        errlog("libuv error to open the listening socket: %s", uv_strerror(rc));
     }
 
-    if ((rc = uv_listen((uv_stream_t*) &server_stream, N_BACKLOG, uv_on_peer_connected)) == -1) {
+    if ((rc = uv_listen((uv_stream_t*) &worker->server_stream, listen_backlog, uv_on_peer_connected)) < 0) {
         errlog("libuv error to listen: %s", uv_strerror(rc));
     }
 
-    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    printf("libuv loop %d listening on socket %d\n", worker->id, sockfd);
+
+    // NOTE: libuv issues the syscalls and runs the poll phase itself, only the peer counters are kept for its loops
+    stats_register("libuv");
+
+    uv_run(&worker->loop, UV_RUN_DEFAULT);
+
+    return 0;
+}
+
+// NOTE: runs after every loop stopped, closes what's left on the loop so it can be released
+int
+close_uv_worker(uv_worker_t* worker) {
+    uv_walk(&worker->loop, uv_on_walk_close, worker);
+    uv_run(&worker->loop, UV_RUN_DEFAULT);
+
+    printf("libuv loop %d stats\n", worker->id);
+    uv_loop_pools_print_stats(worker->ctx.pools, stdout);
+
+    int rc = uv_loop_close(&worker->loop);
+
+    if (worker->ctx.timers != NULL) {
+        timer_wheel_destroy(worker->ctx.timers);
+    }
+
+    uv_loop_pools_destroy(worker->ctx.pools);
+
+    return rc;
+}
+
+int
+event_driven_libuv_server(int port, int nloops) {
+    if (nloops <= 0) {
+        errlog("libuv server needs at least one loop, got %d", nloops);
+    }
+
+    uv_worker_t* workers = (uv_worker_t*) calloc(nloops, sizeof(uv_worker_t));
+    uv_async_t** stop_handles = (uv_async_t**) calloc(nloops, sizeof(uv_async_t*));
+    pthread_t* threads = (pthread_t*) calloc(nloops, sizeof(pthread_t));
+
+    if (workers == NULL || stop_handles == NULL || threads == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    int rc;
+
+    // NOTE: every loop is ready to be stopped before any of them starts to accept peers
+    for (int i = 0; i < nloops; i++) {
+        uv_worker_t* worker = &workers[i];
+
+        worker->id = i;
+        worker->port = port;
+        worker->reuseport = nloops > 1;
+
+        if ((rc = uv_loop_init(&worker->loop)) < 0) {
+            errlog("libuv error to initialize loop: %s", uv_strerror(rc));
+        }
+
+        if ((rc = uv_async_init(&worker->loop, &worker->stop_handle, uv_on_stop_requested)) < 0) {
+            errlog("libuv error to initialize async handle: %s", uv_strerror(rc));
+        }
+
+        if ((rc = uv_timer_init(&worker->loop, &worker->timer_handle)) < 0) {
+            errlog("libuv error to initialize timer: %s", uv_strerror(rc));
+        }
+
+        stop_handles[i] = &worker->stop_handle;
+
+        worker->ctx.pools = uv_loop_pools_create();
+        worker->ctx.stop_handles = stop_handles;
+        worker->ctx.nloops = nloops;
+        worker->ctx.timers = peer_timeouts_enabled() ? timer_wheel_create(uv_loop_tick(&worker->loop)) : NULL;
+        worker->ctx.timer_handle = &worker->timer_handle;
+        worker->loop.data = &worker->ctx;
+    }
+
+    if (nloops == 1) {
+        start_uv_worker(&workers[0]);
+    } else {
+        for (int i = 0; i < nloops; i++) {
+            if (pthread_create(&threads[i], NULL, start_uv_worker, &workers[i]) != 0) {
+                errlog("error to create libuv loop %d", i);
+            }
+        }
+
+        for (int i = 0; i < nloops; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    rc = 0;
+
+    for (int i = 0; i < nloops; i++) {
+        int close_rc = close_uv_worker(&workers[i]);
+
+        if (close_rc < 0) {
+            rc = close_rc;
+        }
+    }
+
+    free(threads);
+    free(stop_handles);
+    free(workers);
 
-    return uv_loop_close(uv_default_loop());
+    return rc;
 }
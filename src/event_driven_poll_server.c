@@ -0,0 +1,269 @@
+// NOTE: portable readiness backend like select, without its limits: the loop keeps a compact pollfd array of the
+// listening socket and the live peers only, so a wakeup costs the peers connected instead of a scan up to the highest
+// fd, and any fd the process can open fits (select stops at FD_SETSIZE). A closed peer is swap-removed with the last
+// entry and an fd -> index map finds the entry of a peer without searching
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "headers/error.h"
+#include "headers/servers.h"
+
+#define POLL_SET_INITIAL_SIZE 64
+
+typedef struct {
+    struct pollfd* fds;
+    int len;
+    int cap;
+    // NOTE: position of every watched fd on fds, -1 for the others
+    int* index;
+    int index_len;
+} poll_set_t;
+
+typedef struct {
+    poll_set_t* set;
+    peer_table_t* peer_table;
+} poll_timer_ctx_t;
+
+void
+poll_set_init(poll_set_t* set) {
+    set->fds = (struct pollfd*) malloc(POLL_SET_INITIAL_SIZE * sizeof(struct pollfd));
+    set->len = 0;
+    set->cap = POLL_SET_INITIAL_SIZE;
+    set->index = NULL;
+    set->index_len = 0;
+
+    if (set->fds == NULL) {
+        errlog("error to allocate memory");
+    }
+}
+
+void
+poll_set_add(poll_set_t* set, int fd, short events) {
+    if (set->len == set->cap) {
+        struct pollfd* fds = (struct pollfd*) realloc(set->fds, set->cap * 2 * sizeof(struct pollfd));
+
+        if (fds == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        set->fds = fds;
+        set->cap *= 2;
+    }
+
+    if (fd >= set->index_len) {
+        int index_len = set->index_len > 0 ? set->index_len : POLL_SET_INITIAL_SIZE;
+
+        while (index_len <= fd) {
+            index_len *= 2;
+        }
+
+        int* index = (int*) realloc(set->index, index_len * sizeof(int));
+
+        if (index == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        for (int i = set->index_len; i < index_len; i++) {
+            index[i] = -1;
+        }
+
+        set->index = index;
+        set->index_len = index_len;
+    }
+
+    // NOTE: no revents, a peer accepted during a round isn't served until the next poll
+    set->fds[set->len] = (struct pollfd) {.fd = fd, .events = events, .revents = 0};
+    set->index[fd] = set->len;
+    set->len++;
+}
+
+void
+poll_set_update(poll_set_t* set, int fd, short events) {
+    set->fds[set->index[fd]].events = events;
+}
+
+// NOTE: the last entry takes the place of the removed one, so the array stays compact
+void
+poll_set_remove(poll_set_t* set, int fd) {
+    int i = set->index[fd];
+    int last = set->len - 1;
+
+    if (i != last) {
+        set->fds[i] = set->fds[last];
+        set->index[set->fds[i].fd] = i;
+    }
+
+    set->index[fd] = -1;
+    set->len--;
+}
+
+short
+poll_events_from_status(fd_status_t status) {
+    short events = 0;
+
+    if (status.want_read) {
+        events |= POLLIN;
+    }
+
+    if (status.want_write) {
+        events |= POLLOUT;
+    }
+
+    return events;
+}
+
+void
+poll_close_peer(poll_set_t* set, peer_table_t* peer_table, int fd) {
+    log_info("socket %d closing", fd);
+
+    on_peer_closed(peer_table, fd);
+    poll_set_remove(set, fd);
+    close(fd);
+}
+
+void
+poll_on_peer_timer(timer_entry_t* entry, void* arg) {
+    poll_timer_ctx_t* ctx = (poll_timer_ctx_t*) arg;
+    int fd = (int) entry->key;
+
+    if (peer_timer_fired(ctx->peer_table->timers, peer_table_get(ctx->peer_table, fd), entry)) {
+        log_info("socket %d timed out", fd);
+
+        poll_close_peer(ctx->set, ctx->peer_table, fd);
+    }
+}
+
+// NOTE: the same handling as epoll_on_peer_ready, poll reports a hang up even when only writing is asked for and recv
+// sees it as the end of the stream
+void
+poll_on_peer_ready(poll_set_t* set, peer_table_t* peer_table, int fd, short revents) {
+    if ((revents & POLLERR) && !on_peer_ready_error(peer_table, fd)) {
+        poll_close_peer(set, peer_table, fd);
+
+        return;
+    }
+
+    fd_status_t status = peer_status(peer_table_get(peer_table, fd));
+
+    if (revents & (POLLIN | POLLHUP)) {
+        status = on_peer_ready_recv(peer_table, fd);
+
+        if (!status.want_read && !status.want_write) {
+            poll_close_peer(set, peer_table, fd);
+
+            return;
+        }
+    }
+
+    if ((revents & POLLOUT) && status.want_write) {
+        status = on_peer_ready_send(peer_table, fd);
+    }
+
+    if (!status.want_read && !status.want_write) {
+        poll_close_peer(set, peer_table, fd);
+    } else {
+        poll_set_update(set, fd, poll_events_from_status(status));
+    }
+}
+
+void
+event_driven_poll_server(int sockfd) {
+    make_sock_nonblocking(sockfd);
+
+    poll_set_t set;
+
+    poll_set_init(&set);
+
+    // NOTE: the listening socket is the first entry for good, a swap-remove only ever moves peers
+    poll_set_add(&set, sockfd, POLLIN);
+
+    peer_table_t* peer_table = peer_table_create();
+
+    if (peer_timeouts_enabled()) {
+        peer_table->timers = timer_wheel_create(timer_wheel_clock());
+    }
+
+    poll_timer_ctx_t timer_ctx = {.set = &set, .peer_table = peer_table};
+
+    stats_register("poll");
+
+    while (1) {
+        // NOTE: the wait only returns earlier than the events when a slot of the timer wheel is due
+        int timeout = peer_table->timers != NULL ? timer_wheel_timeout_ms(peer_table->timers, timer_wheel_clock()) : -1;
+        int ready_len = poll(set.fds, set.len, timeout);
+
+        if (ready_len == -1) {
+            if (errno != EINTR) {
+                errlog("error on poll get ready state");
+            }
+
+            ready_len = 0;
+        }
+
+        uint64_t started_ns = stats_clock_ns();
+
+        stats_add(&stats_current->syscalls, 1);
+        stats_hist_add(&stats_current->events_per_wait, ready_len);
+
+        if (peer_table->timers != NULL) {
+            peer_table->now = timer_wheel_clock();
+        }
+
+        short accept_events = set.fds[0].revents;
+
+        if (accept_events != 0) {
+            if (accept_events & (POLLERR | POLLNVAL)) {
+                errlog("poll events contains an error");
+            }
+
+            ready_len--;
+        }
+
+        for (int i = 1; i < set.len && ready_len > 0;) {
+            int fd = set.fds[i].fd;
+            short revents = set.fds[i].revents;
+
+            if (revents == 0) {
+                i++;
+
+                continue;
+            }
+
+            set.fds[i].revents = 0;
+            ready_len--;
+
+            poll_on_peer_ready(&set, peer_table, fd, revents);
+
+            // NOTE: a closed peer was swapped with the last entry, which wasn't served yet
+            if (set.index[fd] == i) {
+                i++;
+            }
+        }
+
+        // NOTE: the new peers are accepted after the ready ones were served, the listening socket is reported again
+        // while its backlog isn't empty
+        if (accept_events & POLLIN) {
+            accepted_peer_t peers[ACCEPT_BUDGET];
+            bool drained;
+
+            int accepted = accept_peers(sockfd, peers, ACCEPT_BUDGET, &drained);
+
+            for (int i = 0; i < accepted; i++) {
+                fd_status_t status = on_peer_connected(peer_table, peers[i].sockfd, &peers[i].addr, peers[i].addr_len);
+
+                poll_set_add(&set, peers[i].sockfd, poll_events_from_status(status));
+            }
+        }
+
+        // NOTE: after the ready entries, a peer closed by its timer could still be on them
+        if (peer_table->timers != NULL) {
+            timer_wheel_advance(peer_table->timers, peer_table->now, poll_on_peer_timer, &timer_ctx);
+        }
+
+        stats_loop_iteration(started_ns);
+    }
+}
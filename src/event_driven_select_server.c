@@ -8,6 +8,28 @@
 #include "headers/error.h"
 #include "headers/servers.h"
 
+typedef struct {
+    peer_table_t* peer_table;
+    fd_set* master_read_fd;
+    fd_set* master_write_fd;
+} select_timer_ctx_t;
+
+void
+select_on_peer_timer(timer_entry_t* entry, void* arg) {
+    select_timer_ctx_t* ctx = (select_timer_ctx_t*) arg;
+    int fd = (int) entry->key;
+
+    if (peer_timer_fired(ctx->peer_table->timers, peer_table_get(ctx->peer_table, fd), entry)) {
+        log_info("socket %d timed out", fd);
+
+        FD_CLR(fd, ctx->master_read_fd);
+        FD_CLR(fd, ctx->master_write_fd);
+
+        on_peer_closed(ctx->peer_table, fd);
+        close(fd);
+    }
+}
+
 void
 event_driven_select_server(int sockfd) {
     make_sock_nonblocking(sockfd);
@@ -28,16 +50,53 @@ event_driven_select_server(int sockfd) {
     // NOTE: improve iteration efficiency
     int fdset_max = sockfd;
 
+    peer_table_t* peer_table = peer_table_create();
+
+    if (peer_timeouts_enabled()) {
+        peer_table->timers = timer_wheel_create(timer_wheel_clock());
+    }
+
+    select_timer_ctx_t timer_ctx = {
+        .peer_table = peer_table,
+        .master_read_fd = &master_read_fd,
+        .master_write_fd = &master_write_fd,
+    };
+
+    stats_register("select");
+
     while (1) {
         // NOTE: select call modify the state, because this we get a copy of the state
         fd_set read_fd_copy = master_read_fd, write_fd_copy = master_write_fd;
 
-        int ready_len = select(fdset_max + 1, &read_fd_copy, &write_fd_copy, NULL, NULL);
+        // NOTE: the wait only returns earlier than the events when a slot of the timer wheel is due
+        struct timeval timeout;
+        struct timeval* timeout_ptr = NULL;
+
+        if (peer_table->timers != NULL) {
+            int timeout_ms = timer_wheel_timeout_ms(peer_table->timers, timer_wheel_clock());
+
+            if (timeout_ms >= 0) {
+                timeout.tv_sec = timeout_ms / 1000;
+                timeout.tv_usec = (timeout_ms % 1000) * 1000;
+                timeout_ptr = &timeout;
+            }
+        }
+
+        int ready_len = select(fdset_max + 1, &read_fd_copy, &write_fd_copy, NULL, timeout_ptr);
 
         if (ready_len == -1) {
             errlog("error on select get ready state");
         }
 
+        uint64_t started_ns = stats_clock_ns();
+
+        stats_add(&stats_current->syscalls, 1);
+        stats_hist_add(&stats_current->events_per_wait, ready_len);
+
+        if (peer_table->timers != NULL) {
+            peer_table->now = timer_wheel_clock();
+        }
+
         for (int fd = 0; fd <= fdset_max && ready_len > 0; fd++) {
             // NOTE: verify if the fd becomes readable
             if (FD_ISSET(fd, &read_fd_copy)) {
@@ -45,46 +104,44 @@ event_driven_select_server(int sockfd) {
 
                 // NOTE: the listening socket is ready, so a new peer is connecting
                 if (fd == sockfd) {
-                    struct sockaddr_in peer_addr;
-                    socklen_t peer_addr_len = sizeof(peer_addr);
+                    accepted_peer_t peers[ACCEPT_BUDGET];
+                    bool drained;
 
-                    int sockfd_new = accept(sockfd, (struct sockaddr*) &peer_addr, &peer_addr_len);
+                    // NOTE: a connection storm is accepted in batches, the rest is reported again on the next round
+                    int accepted = accept_peers(sockfd, peers, ACCEPT_BUDGET, &drained);
 
-                    if (sockfd_new == -1) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            // NOTE: can happen due to nonblocking socker mode, is not an error but it's a extremely
-                            // rare event
-                            printf("accept returned EAGAIN or EWOULDBLOCK\n");
-                        } else {
-                            errlog("error to accept socket connection");
+                    for (int i = 0; i < accepted; i++) {
+                        int sockfd_new = peers[i].sockfd;
+
+                        if (sockfd_new >= FD_SETSIZE) {
+                            // NOTE: select can't watch it, refuse the peer instead of stopping the server
+                            log_warn("socket fd (%d) >= FD_SETSIZE (%d), closing", sockfd_new, FD_SETSIZE);
+                            close(sockfd_new);
+
+                            continue;
                         }
-                    } else {
-                        make_sock_nonblocking(sockfd_new);
 
                         if (sockfd_new > fdset_max) {
-                            if (sockfd_new >= FD_SETSIZE) {
-                                errlog("socket fd (%d) >= FD_SETSIZE (%d)", sockfd_new, FD_SETSIZE);
-                            }
-
                             fdset_max = sockfd_new;
                         }
-                    }
 
-                    fd_status_t status = on_peer_connected(sockfd_new, &peer_addr, peer_addr_len);
+                        fd_status_t status =
+                            on_peer_connected(peer_table, sockfd_new, &peers[i].addr, peers[i].addr_len);
 
-                    if (status.want_read) {
-                        FD_SET(sockfd_new, &master_read_fd);
-                    } else {
-                        FD_CLR(sockfd_new, &master_read_fd);
-                    }
+                        if (status.want_read) {
+                            FD_SET(sockfd_new, &master_read_fd);
+                        } else {
+                            FD_CLR(sockfd_new, &master_read_fd);
+                        }
 
-                    if (status.want_write) {
-                        FD_SET(sockfd_new, &master_write_fd);
-                    } else {
-                        FD_CLR(sockfd_new, &master_write_fd);
+                        if (status.want_write) {
+                            FD_SET(sockfd_new, &master_write_fd);
+                        } else {
+                            FD_CLR(sockfd_new, &master_write_fd);
+                        }
                     }
                 } else {
-                    fd_status_t status = on_peer_ready_recv(fd);
+                    fd_status_t status = on_peer_ready_recv(peer_table, fd);
 
                     if (status.want_read) {
                         FD_SET(fd, &master_read_fd);
@@ -99,8 +156,12 @@ event_driven_select_server(int sockfd) {
                     }
 
                     if (!status.want_read && !status.want_write) {
-                        printf("socket %d closing\n", fd);
+                        log_info("socket %d closing", fd);
+                        on_peer_closed(peer_table, fd);
                         close(fd);
+
+                        // NOTE: the peer may also be on the write set of this round
+                        continue;
                     }
                 }
             }
@@ -108,7 +169,7 @@ event_driven_select_server(int sockfd) {
             if (FD_ISSET(fd, &write_fd_copy)) {
                 ready_len--;
 
-                fd_status_t status = on_peer_ready_send(fd);
+                fd_status_t status = on_peer_ready_send(peer_table, fd);
 
                 if (status.want_read) {
                     FD_SET(fd, &master_read_fd);
@@ -123,10 +184,18 @@ event_driven_select_server(int sockfd) {
                 }
 
                 if (!status.want_read && !status.want_write) {
-                    printf("socket %d closing\n", fd);
+                    log_info("socket %d closing", fd);
+                    on_peer_closed(peer_table, fd);
                     close(fd);
                 }
             }
         }
+
+        // NOTE: after the ready sets, a peer closed by its timer could still be on them
+        if (peer_table->timers != NULL) {
+            timer_wheel_advance(peer_table->timers, peer_table->now, select_on_peer_timer, &timer_ctx);
+        }
+
+        stats_loop_iteration(started_ns);
     }
 }
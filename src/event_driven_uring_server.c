@@ -0,0 +1,416 @@
+// NOTE: proactor pattern, instead of waiting for readiness and then issuing the syscall (reactor) the operations are
+// submitted up-front and the loop only reacts to their completions. A single multishot accept and one multishot recv
+// per peer stay armed, recv buffers are picked by the kernel from a provided buffer ring and every submission queued
+// while handling a batch of completions goes to the kernel on the same io_uring_enter call
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "headers/error.h"
+#include "headers/servers.h"
+#include "headers/uring.h"
+
+#define URING_ENTRIES 1024
+#define URING_BGID 0
+// NOTE: the output is queued on the peer send queue, so the buffer size only bounds how much a single recv returns
+#define URING_BUF_SIZE 4096
+#define URING_NBUFS 1024
+// NOTE: the share of the buffer ring a single peer may hold, its recv is cancelled past it. A peer that floods and
+// never reads its output could otherwise take every buffer and starve the others
+#define URING_PEER_MAX_BUFS 16
+
+typedef enum { URING_OP_ACCEPT, URING_OP_RECV, URING_OP_SEND, URING_OP_CANCEL, URING_OP_ACCEPT_RETRY } uring_op_t;
+
+// NOTE: a multishot accept that failed (out of fds or memory) is only submitted again after this delay, the kernel
+// reserves the fd before it looks at the backlog so a new accept would fail right away
+static struct __kernel_timespec uring_accept_backoff = {.tv_sec = 0, .tv_nsec = 100 * 1000 * 1000};
+
+// NOTE: received buffers waiting for the peer output to drain, chained by buffer id
+static int uring_buf_next[URING_NBUFS];
+static int uring_buf_len[URING_NBUFS];
+
+// NOTE: the peers whose recv ended with ENOBUFS, they are re-armed once buffers are given back to the ring instead of
+// right away (which would only fail again)
+static int* uring_starved;
+static int uring_starved_len;
+static int uring_starved_cap;
+static bool uring_bufs_returned;
+
+// NOTE: the op on the top 4 bits, the fd on the next 28 and an argument of the op on the low 32: the zerocopy id of a
+// send, its notification carries the same user data
+uint64_t
+uring_user_data(uring_op_t op, int sockfd, uint32_t arg) {
+    return ((uint64_t) op << 60) | ((uint64_t) (sockfd & 0x0fffffff) << 32) | arg;
+}
+
+void
+uring_submit_accept(uring_t* uring, int sockfd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(uring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    // NOTE: a multishot accept already takes the whole backlog per submission, the peers are never read in blocking
+    // mode so they only need close-on-exec
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_user_data(URING_OP_ACCEPT, sockfd, 0);
+}
+
+void
+uring_submit_accept_retry(uring_t* uring, int sockfd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(uring);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) &uring_accept_backoff;
+    sqe->len = 1;
+    sqe->user_data = uring_user_data(URING_OP_ACCEPT_RETRY, sockfd, 0);
+}
+
+// NOTE: out of fds, the peers waiting on the backlog are refused with the reserve fd (see accept_shed_peer) so they
+// don't wait for the retry. The listening socket is blocking, it's only accepted on while poll reports it ready
+void
+uring_shed_backlog(int sockfd) {
+    struct pollfd listener = {.fd = sockfd, .events = POLLIN};
+    bool drained = false;
+
+    for (int i = 0; i < ACCEPT_BUDGET && accept_reserve_fd != -1 && poll(&listener, 1, 0) == 1; i++) {
+        if (!accept_shed_peer(sockfd, &drained)) {
+            break;
+        }
+    }
+}
+
+void
+uring_submit_recv(uring_t* uring, peer_state_t* peer_state, int sockfd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(uring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sockfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = uring_user_data(URING_OP_RECV, sockfd, 0);
+
+    peer_state->recv_armed = true;
+    peer_state->inflight++;
+}
+
+// NOTE: a linked send holds the next submitted operation until the whole output is on the socket. Only the head chunk
+// of the send queue is sent, appending to the queue never moves the bytes already queued. Past the zerocopy threshold
+// the kernel sends from the chunk itself and posts a second completion (notification) once it's done with it
+void
+uring_submit_send(uring_t* uring, peer_state_t* peer_state, int sockfd, bool link) {
+    struct io_uring_sqe* sqe = uring_get_sqe(uring);
+    send_chunk_t* head = peer_state->send_queue.head;
+    bool zerocopy = peer_state->send_queue.zerocopy != NULL && head->end - head->start >= send_queue_zerocopy_threshold;
+
+    sqe->opcode = zerocopy ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+    sqe->fd = sockfd;
+    sqe->addr = (unsigned long) &head->data[head->start];
+    sqe->len = head->end - head->start;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    // NOTE: one send in flight per peer, a zerocopy one gets the next id
+    sqe->user_data = uring_user_data(URING_OP_SEND, sockfd, zerocopy ? peer_state->send_queue.zerocopy->next_id : 0);
+
+    if (link) {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+
+    peer_state->send_inflight = true;
+    peer_state->inflight++;
+}
+
+// NOTE: ends the multishot recv of the peer, it completes with ECANCELED (or whatever it was completing with)
+void
+uring_submit_cancel_recv(uring_t* uring, peer_state_t* peer_state, int sockfd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(uring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(URING_OP_RECV, sockfd, 0);
+    sqe->user_data = uring_user_data(URING_OP_CANCEL, sockfd, 0);
+
+    peer_state->recv_cancelling = true;
+    peer_state->inflight++;
+}
+
+void
+uring_starved_push(peer_state_t* peer_state, int sockfd) {
+    if (uring_starved_len == uring_starved_cap) {
+        int cap = uring_starved_cap > 0 ? uring_starved_cap * 2 : 64;
+        int* starved = (int*) realloc(uring_starved, cap * sizeof(int));
+
+        if (starved == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        uring_starved = starved;
+        uring_starved_cap = cap;
+    }
+
+    uring_starved[uring_starved_len++] = sockfd;
+    peer_state->recv_starved = true;
+}
+
+// NOTE: feed the received buffers to the state machine while the output is below the high watermark, then either send
+// the output, re-arm the recv or close the peer once nothing is in flight anymore
+void
+uring_peer_progress(uring_t* uring, uring_buf_ring_t* buf_ring, peer_table_t* peer_table, int sockfd) {
+    peer_state_t* peer_state = peer_table_get(peer_table, sockfd);
+
+    while (peer_state->pending_head != -1
+           && (peer_state->closing || peer_state->send_queue.len < send_queue_high_watermark)) {
+        int bid = peer_state->pending_head;
+
+        peer_state->pending_head = uring_buf_next[bid];
+
+        if (peer_state->pending_head == -1) {
+            peer_state->pending_tail = -1;
+        }
+
+        peer_state->pending_len--;
+
+        if (!peer_state->closing) {
+            bool read_closed = peer_state->read_closed;
+
+            on_peer_data(peer_state, uring_buf_ring_get(buf_ring, bid), uring_buf_len[bid]);
+
+            // NOTE: a broken frame, the shutdown ends the armed recv the same way the EOF of the peer does
+            if (!read_closed && peer_state->read_closed && peer_state->recv_armed) {
+                shutdown(sockfd, SHUT_RD);
+            }
+        }
+
+        uring_buf_ring_add(buf_ring, bid);
+
+        uring_bufs_returned = true;
+    }
+
+    // NOTE: the peer finished sending and all its output is flushed
+    if (peer_state->read_closed && peer_state->pending_head == -1 && peer_state->send_queue.len == 0) {
+        peer_state->closing = true;
+    }
+
+    if (peer_state->closing) {
+        peer_state->recv_starved = false;
+
+        if (peer_state->inflight == 0 && !send_queue_zerocopy_pending(&peer_state->send_queue)) {
+            log_info("socket %d closing", sockfd);
+            on_peer_closed(peer_table, sockfd);
+            close(sockfd);
+        }
+    } else if (peer_state->send_queue.len > 0 && !peer_state->send_inflight) {
+        uring_submit_send(uring, peer_state, sockfd, false);
+    }
+
+    // NOTE: a paused peer keeps its recv armed otherwise, the kernel would go on filling buffers it can't process
+    if (!peer_state->closing && peer_state->recv_armed && !peer_state->recv_cancelling
+        && (peer_state->read_paused || peer_state->pending_len >= URING_PEER_MAX_BUFS)) {
+        uring_submit_cancel_recv(uring, peer_state, sockfd);
+    }
+
+    if (!peer_state->closing && !peer_state->recv_armed && !peer_state->recv_starved && peer_state->pending_head == -1
+        && peer_status(peer_state).want_read) {
+        uring_submit_recv(uring, peer_state, sockfd);
+    }
+}
+
+// NOTE: after a batch of completions that gave buffers back to the ring
+void
+uring_rearm_starved(uring_t* uring, uring_buf_ring_t* buf_ring, peer_table_t* peer_table) {
+    int len = uring_starved_len;
+
+    uring_starved_len = 0;
+    uring_bufs_returned = false;
+
+    // NOTE: a closed peer or one already re-armed has the flag cleared, an fd may be listed twice
+    for (int i = 0; i < len; i++) {
+        peer_state_t* peer_state = peer_table_get(peer_table, uring_starved[i]);
+
+        if (peer_state->recv_starved) {
+            peer_state->recv_starved = false;
+
+            uring_peer_progress(uring, buf_ring, peer_table, uring_starved[i]);
+        }
+    }
+}
+
+void
+uring_on_accept(uring_t* uring, peer_table_t* peer_table, int sockfd) {
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+
+    // NOTE: the peer may already have reset the connection (ENOTCONN), only that one is dropped
+    if (getpeername(sockfd, (struct sockaddr*) &peer_addr, &peer_addr_len) == -1) {
+        log_error("%s:%d: error to get peer name: %s", __FILE__, __LINE__, strerror(errno));
+        close(sockfd);
+
+        return;
+    }
+
+    on_peer_connected(peer_table, sockfd, &peer_addr, peer_addr_len);
+
+    peer_state_t* peer_state = peer_table_get(peer_table, sockfd);
+
+    // NOTE: SEND_ZC reports on the completion queue, the socket doesn't need SO_ZEROCOPY
+    if (send_queue_zerocopy_threshold > 0) {
+        send_queue_enable_zerocopy(&peer_state->send_queue);
+    }
+
+    peer_state->inflight = 0;
+    peer_state->recv_armed = false;
+    peer_state->recv_cancelling = false;
+    peer_state->recv_starved = false;
+    peer_state->pending_len = 0;
+    peer_state->send_inflight = false;
+    peer_state->closing = false;
+    peer_state->pending_head = -1;
+    peer_state->pending_tail = -1;
+
+    // NOTE: the recv only starts after the '*' was sent, the peer data is never processed in the INITIAL_ACK state
+    uring_submit_send(uring, peer_state, sockfd, true);
+    uring_submit_recv(uring, peer_state, sockfd);
+}
+
+void
+uring_on_recv(peer_state_t* peer_state, int sockfd, struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        peer_state->recv_armed = false;
+        peer_state->inflight--;
+    }
+
+    if (cqe->res > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        uring_buf_len[bid] = cqe->res;
+        uring_buf_next[bid] = -1;
+
+        if (peer_state->pending_tail == -1) {
+            peer_state->pending_head = bid;
+        } else {
+            uring_buf_next[peer_state->pending_tail] = bid;
+        }
+
+        peer_state->pending_tail = bid;
+        peer_state->pending_len++;
+    } else if (cqe->res == 0) {
+        // NOTE: peer disconnected, what's still pending is flushed before closing
+        peer_state->read_closed = true;
+    } else if (cqe->res == -ENOBUFS) {
+        uring_starved_push(peer_state, sockfd);
+    } else if (cqe->res != -ECANCELED) {
+        // NOTE: the connection failed
+        peer_state->closing = true;
+    }
+}
+
+void
+uring_on_send(peer_state_t* peer_state, struct io_uring_cqe* cqe) {
+    // NOTE: zerocopy notification, the kernel is done with the chunk of that send. They may come out of order, a
+    // retransmit can hold one back
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+        uint32_t id = (uint32_t) cqe->user_data;
+
+        send_queue_zerocopy_completed(&peer_state->send_queue, id, id);
+
+        return;
+    }
+
+    peer_state->send_inflight = false;
+    peer_state->inflight--;
+
+    // NOTE: the notification of a zerocopy send follows, the peer isn't closed before every one arrived. They are
+    // counted by the zerocopy ids rather than on inflight, a slow peer can have hundreds of them pending
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        send_queue_zerocopy_sent(&peer_state->send_queue, 1);
+    }
+
+    if (cqe->res < 0) {
+        log_error("%s:%d: error to send data on socket: %s", __FILE__, __LINE__, strerror(-cqe->res));
+
+        peer_state->closing = true;
+    } else {
+        on_peer_data_sent(peer_state, cqe->res);
+    }
+}
+
+void
+event_driven_uring_server(int sockfd) {
+    uring_t uring;
+    uring_buf_ring_t buf_ring;
+
+    uring_init(&uring, URING_ENTRIES);
+    uring_buf_ring_init(&uring, &buf_ring, URING_BGID, URING_NBUFS, URING_BUF_SIZE);
+
+    peer_table_t* peer_table = peer_table_create();
+
+    accept_reserve_init();
+    uring_submit_accept(&uring, sockfd);
+
+    stats_register("uring");
+
+    while (1) {
+        uring_submit_and_wait(&uring, 1);
+
+        uint64_t started_ns = stats_clock_ns();
+        int completions = 0;
+
+        struct io_uring_cqe* cqe;
+
+        while ((cqe = uring_peek_cqe(&uring)) != NULL) {
+            completions++;
+
+            uring_op_t op = (uring_op_t) (cqe->user_data >> 60);
+            int fd = (int) ((cqe->user_data >> 32) & 0x0fffffff);
+
+            if (op == URING_OP_ACCEPT) {
+                if (cqe->res >= 0) {
+                    uring_on_accept(&uring, peer_table, cqe->res);
+                } else {
+                    log_error("%s:%d: error to accept: %s", __FILE__, __LINE__, strerror(-cqe->res));
+
+                    if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+                        uring_shed_backlog(sockfd);
+                    }
+                }
+
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    if (cqe->res >= 0) {
+                        uring_submit_accept(&uring, sockfd);
+                    } else {
+                        uring_submit_accept_retry(&uring, sockfd);
+                    }
+                }
+            } else if (op == URING_OP_ACCEPT_RETRY) {
+                uring_submit_accept(&uring, sockfd);
+            } else {
+                peer_state_t* peer_state = peer_table_get(peer_table, fd);
+
+                if (op == URING_OP_RECV) {
+                    uring_on_recv(peer_state, fd, cqe);
+                } else if (op == URING_OP_CANCEL) {
+                    peer_state->recv_cancelling = false;
+                    peer_state->inflight--;
+                } else {
+                    uring_on_send(peer_state, cqe);
+                }
+
+                uring_peer_progress(&uring, &buf_ring, peer_table, fd);
+            }
+
+            uring_cqe_seen(&uring);
+        }
+
+        if (uring_bufs_returned && uring_starved_len > 0) {
+            uring_rearm_starved(&uring, &buf_ring, peer_table);
+        }
+
+        stats_hist_add(&stats_current->events_per_wait, completions);
+        stats_loop_iteration(started_ns);
+    }
+}
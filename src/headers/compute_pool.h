@@ -0,0 +1,334 @@
+#ifndef HEADERS_COMPUTE_POOL_H
+#define HEADERS_COMPUTE_POOL_H
+
+// NOTE: work-stealing thread pool for the CPU-bound requests, so a long computation never stalls the event loop of the
+// other peers. Every worker owns a deque: jobs submitted by the loops are spread round-robin over the bottoms, the
+// owner pops from the bottom (the newest job, still on cache) and an idle worker steals from the top of the others (the
+// oldest job). A deque is guarded by a lock of its own, so the workers only contend while stealing.
+//
+// a finished job goes to the completion queue of the loop that submitted it: a lock-free stack pushed by the workers
+// and swapped out whole by the loop. Only the push that finds the stack empty notifies the loop (eventfd write or
+// uv_async_send), the jobs finished before the loop drained ride on the same wakeup
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "stats.h"
+
+#define COMPUTE_DEQUE_INITIAL_SIZE 64
+
+struct compute_completion;
+
+// NOTE: embedded on the job of the caller, run is called on a worker and complete back on the loop thread
+typedef struct compute_job {
+    void (*run)(struct compute_job* job);
+    void (*complete)(struct compute_job* job);
+    struct compute_completion* completion;
+    struct compute_job* next;
+} compute_job_t;
+
+typedef struct compute_completion {
+    compute_job_t* done;
+    void (*notify)(struct compute_completion* completion);
+    // NOTE: eventfd the loop polls, -1 when notify is something else (a libuv async handle on data)
+    int eventfd;
+    void* data;
+} compute_completion_t;
+
+typedef struct {
+    // NOTE: ring of cap slots, the jobs live on [top, bottom)
+    compute_job_t** jobs;
+    uint64_t cap;
+    uint64_t top;
+    uint64_t bottom;
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) compute_deque_t;
+
+typedef struct compute_pool {
+    compute_deque_t* deques;
+    int nworkers;
+    // NOTE: jobs submitted and not taken by a worker yet, the workers sleep while it's zero
+    uint64_t pending;
+    uint32_t next_deque;
+    int sleepers;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wakeup;
+} compute_pool_t;
+
+typedef struct {
+    compute_pool_t* pool;
+    int id;
+} compute_worker_config_t;
+
+void
+compute_deque_push(compute_deque_t* deque, compute_job_t* job) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top == deque->cap) {
+        compute_job_t** jobs = (compute_job_t**) malloc(deque->cap * 2 * sizeof(compute_job_t*));
+
+        if (jobs == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        for (uint64_t i = deque->top; i < deque->bottom; i++) {
+            jobs[i & (deque->cap * 2 - 1)] = deque->jobs[i & (deque->cap - 1)];
+        }
+
+        free(deque->jobs);
+
+        deque->jobs = jobs;
+        deque->cap *= 2;
+    }
+
+    deque->jobs[deque->bottom & (deque->cap - 1)] = job;
+    deque->bottom++;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// NOTE: the owner takes the newest job, a thief the oldest one
+compute_job_t*
+compute_deque_take(compute_deque_t* deque, bool steal) {
+    compute_job_t* job = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom != deque->top) {
+        if (steal) {
+            job = deque->jobs[deque->top & (deque->cap - 1)];
+            deque->top++;
+        } else {
+            deque->bottom--;
+            job = deque->jobs[deque->bottom & (deque->cap - 1)];
+        }
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return job;
+}
+
+// NOTE: called from any worker, the loop owning the completion queue may be draining it at the same time
+void
+compute_completion_push(compute_completion_t* completion, compute_job_t* job) {
+    compute_job_t* head = __atomic_load_n(&completion->done, __ATOMIC_RELAXED);
+
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&completion->done, &head, job, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        completion->notify(completion);
+    }
+}
+
+// NOTE: runs the complete callback of every finished job on the calling loop, in the order they finished. Returns how
+// many there were
+size_t
+compute_completion_drain(compute_completion_t* completion) {
+    if (completion->eventfd != -1) {
+        uint64_t count;
+
+        // NOTE: resets the counter, a job finishing after the swap below writes it again
+        if (read(completion->eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            errlog("error to read the completion eventfd");
+        }
+    }
+
+    compute_job_t* job = __atomic_exchange_n(&completion->done, NULL, __ATOMIC_ACQUIRE);
+    compute_job_t* ordered = NULL;
+    size_t ncompleted = 0;
+
+    // NOTE: the stack has the newest job on top
+    while (job != NULL) {
+        compute_job_t* next = job->next;
+
+        job->next = ordered;
+        ordered = job;
+        job = next;
+    }
+
+    while (ordered != NULL) {
+        compute_job_t* next = ordered->next;
+
+        ordered->complete(ordered);
+
+        ordered = next;
+        ncompleted++;
+    }
+
+    return ncompleted;
+}
+
+void
+compute_completion_notify_eventfd(compute_completion_t* completion) {
+    uint64_t one = 1;
+
+    if (write(completion->eventfd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        errlog("error to write the completion eventfd");
+    }
+}
+
+// NOTE: the loop polls completion->eventfd for EPOLLIN and drains when it's readable
+void
+compute_completion_init_eventfd(compute_completion_t* completion) {
+    completion->done = NULL;
+    completion->notify = compute_completion_notify_eventfd;
+    completion->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    completion->data = NULL;
+
+    if (completion->eventfd == -1) {
+        errlog("error to create the completion eventfd");
+    }
+}
+
+// NOTE: notify is called from the workers, data is left for it (e.g. a uv_async_t)
+void
+compute_completion_init(compute_completion_t* completion, void (*notify)(compute_completion_t*), void* data) {
+    completion->done = NULL;
+    completion->notify = notify;
+    completion->eventfd = -1;
+    completion->data = data;
+}
+
+void
+compute_pool_submit(compute_pool_t* pool, compute_job_t* job, compute_completion_t* completion) {
+    job->completion = completion;
+
+    uint32_t i = __atomic_fetch_add(&pool->next_deque, 1, __ATOMIC_RELAXED) % pool->nworkers;
+
+    // NOTE: counted before it's pushed, so a worker taking it right away never sees pending drop below zero. Pairs with
+    // the sleeper that registered before checking pending, one of both sees the other
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    compute_deque_push(&pool->deques[i], job);
+
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->sleep_lock);
+        pthread_cond_signal(&pool->wakeup);
+        pthread_mutex_unlock(&pool->sleep_lock);
+    }
+}
+
+// NOTE: the own deque first, then a steal round over the others starting at the next one
+compute_job_t*
+compute_pool_find_job(compute_pool_t* pool, int id) {
+    compute_job_t* job = compute_deque_take(&pool->deques[id], false);
+
+    for (int k = 1; job == NULL && k < pool->nworkers; k++) {
+        compute_deque_t* victim = &pool->deques[(id + k) % pool->nworkers];
+
+        job = compute_deque_take(victim, true);
+    }
+
+    return job;
+}
+
+void*
+compute_worker(void* arg) {
+    compute_worker_config_t* config = (compute_worker_config_t*) arg;
+    compute_pool_t* pool = config->pool;
+    int id = config->id;
+
+    free(config);
+
+    stats_register("compute");
+
+    while (1) {
+        compute_job_t* job = compute_pool_find_job(pool, id);
+
+        if (job == NULL) {
+            pthread_mutex_lock(&pool->sleep_lock);
+
+            __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+
+            while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+                pthread_cond_wait(&pool->wakeup, &pool->sleep_lock);
+            }
+
+            __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+
+            pthread_mutex_unlock(&pool->sleep_lock);
+
+            continue;
+        }
+
+        __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+        uint64_t started_ns = stats_clock_ns();
+
+        job->run(job);
+
+        // NOTE: a job is an iteration of the worker, the loop time histogram is how long the jobs take
+        stats_loop_iteration(started_ns);
+
+        compute_completion_push(job->completion, job);
+    }
+
+    return 0;
+}
+
+compute_pool_t*
+compute_pool_create(int nworkers) {
+    if (nworkers <= 0) {
+        errlog("compute pool needs at least one worker, got %d", nworkers);
+    }
+
+    compute_pool_t* pool = (compute_pool_t*) calloc(1, sizeof(compute_pool_t));
+
+    if (pool == NULL || posix_memalign((void**) &pool->deques, 64, nworkers * sizeof(compute_deque_t)) != 0) {
+        errlog("error to allocate memory");
+    }
+
+    pool->nworkers = nworkers;
+
+    if (pthread_mutex_init(&pool->sleep_lock, NULL) != 0 || pthread_cond_init(&pool->wakeup, NULL) != 0) {
+        errlog("error to initialize the compute pool lock");
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        compute_deque_t* deque = &pool->deques[i];
+
+        deque->jobs = (compute_job_t**) malloc(COMPUTE_DEQUE_INITIAL_SIZE * sizeof(compute_job_t*));
+        deque->cap = COMPUTE_DEQUE_INITIAL_SIZE;
+        deque->top = 0;
+        deque->bottom = 0;
+
+        if (deque->jobs == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        if (pthread_mutex_init(&deque->lock, NULL) != 0) {
+            errlog("error to initialize the compute deque lock");
+        }
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        compute_worker_config_t* config = (compute_worker_config_t*) malloc(sizeof(compute_worker_config_t));
+        pthread_t worker;
+
+        if (config == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        config->pool = pool;
+        config->id = i;
+
+        if (pthread_create(&worker, NULL, compute_worker, config) != 0) {
+            errlog("error to create compute worker %d", i);
+        }
+
+        pthread_detach(worker);
+    }
+
+    return pool;
+}
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef HEADERS_CORO_H
+#define HEADERS_CORO_H
+
+// NOTE: stackful coroutines (green threads) scheduled M:N on top of epoll, one scheduler per thread. Each peer runs
+// plain blocking code on a small pooled stack: coro_recv/coro_send issue the syscall on the nonblocking socket and, on
+// EAGAIN, park the coroutine until epoll reports the fd ready again. The peers are registered once, edge-triggered on
+// both directions, so waiting costs no epoll_ctl. Outside of a coroutine the wrappers are the plain syscalls, the same
+// code runs on the threaded servers.
+//
+// the switch saves only the callee-saved registers (x86-64), swapcontext would also issue a sigprocmask syscall on
+// every switch. Other architectures fall back to ucontext
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "error.h"
+#include "pool.h"
+
+// NOTE: the state machine keeps a 1 KB buffer and the log formatting a few more, 32 KB leaves room for errlog writing
+// to the unbuffered stderr. The stacks come from malloc and only the pages touched are backed
+#define CORO_STACK_SIZE (32 * 1024)
+#define CORO_POOL_MAX_FREE 4096
+// NOTE: a coroutine that never blocks yields after this many I/O calls, so a busy peer can't starve the others
+#define CORO_IO_BUDGET 16
+
+typedef struct {
+#if defined(__x86_64__)
+    void* sp;
+#else
+    ucontext_t uctx;
+#endif
+} coro_context_t;
+
+typedef struct coro {
+    coro_context_t ctx;
+    void* stack;
+    int fd;
+    // NOTE: the epoll events the coroutine is parked on, zero while it's runnable or running
+    uint32_t waiting;
+    int io_calls;
+    bool done;
+    struct coro* next;
+} coro_t;
+
+typedef void (*coro_fn)(int fd);
+
+typedef struct {
+    int epollfd;
+    coro_context_t main_ctx;
+    coro_t* current;
+    // NOTE: fifo of the runnable coroutines
+    coro_t* run_head;
+    coro_t* run_tail;
+    pool_t stacks;
+    pool_t coros;
+    coro_fn fn;
+    size_t live;
+} coro_scheduler_t;
+
+static __thread coro_scheduler_t* coro_scheduler = NULL;
+
+#if defined(__x86_64__)
+
+// NOTE: coro_switch(&from->sp, to->sp): push the callee-saved registers on the current stack, swap the stack pointers
+// and pop the registers of the other side. The return address left on its stack resumes it
+__asm__(".text\n"
+        ".globl coro_switch\n"
+        ".type coro_switch, @function\n"
+        "coro_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coro_switch, .-coro_switch\n");
+
+void coro_switch(void** from_sp, void* to_sp);
+
+// NOTE: a frame as if coro_switch was called from entry: the six registers, then the address it returns to. At the
+// entry of a function the stack pointer is 8 bytes past a 16 bytes boundary, like after a call
+void
+coro_context_init(coro_context_t* ctx, void* stack, size_t stack_size, void (*entry)(void)) {
+    uintptr_t top = ((uintptr_t) stack + stack_size) & ~(uintptr_t) 15;
+    void** sp = (void**) (top - 16);
+
+    // NOTE: ISO C has no cast from a function pointer to void*
+    memcpy(sp, &entry, sizeof(entry));
+
+    for (int i = 0; i < 6; i++) {
+        *--sp = NULL;
+    }
+
+    ctx->sp = sp;
+}
+
+void
+coro_context_switch(coro_context_t* from, coro_context_t* to) {
+    coro_switch(&from->sp, to->sp);
+}
+
+#else
+
+void
+coro_context_init(coro_context_t* ctx, void* stack, size_t stack_size, void (*entry)(void)) {
+    if (getcontext(&ctx->uctx) == -1) {
+        errlog("error to get the coroutine context");
+    }
+
+    ctx->uctx.uc_stack.ss_sp = stack;
+    ctx->uctx.uc_stack.ss_size = stack_size;
+    ctx->uctx.uc_link = NULL;
+
+    makecontext(&ctx->uctx, entry, 0);
+}
+
+void
+coro_context_switch(coro_context_t* from, coro_context_t* to) {
+    if (swapcontext(&from->uctx, &to->uctx) == -1) {
+        errlog("error to switch the coroutine context");
+    }
+}
+
+#endif
+
+coro_t*
+coro_self(void) {
+    return coro_scheduler != NULL ? coro_scheduler->current : NULL;
+}
+
+void
+coro_scheduler_init(coro_scheduler_t* scheduler, coro_fn fn) {
+    scheduler->epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (scheduler->epollfd == -1) {
+        errlog("error to create epoll queue");
+    }
+
+    scheduler->current = NULL;
+    scheduler->run_head = NULL;
+    scheduler->run_tail = NULL;
+    scheduler->fn = fn;
+    scheduler->live = 0;
+
+    pool_init(&scheduler->stacks, "coro_stack", CORO_STACK_SIZE, CORO_POOL_MAX_FREE);
+    pool_init(&scheduler->coros, "coro", sizeof(coro_t), CORO_POOL_MAX_FREE);
+
+    coro_scheduler = scheduler;
+}
+
+void
+coro_make_runnable(coro_scheduler_t* scheduler, coro_t* coro) {
+    coro->next = NULL;
+
+    if (scheduler->run_tail == NULL) {
+        scheduler->run_head = coro;
+    } else {
+        scheduler->run_tail->next = coro;
+    }
+
+    scheduler->run_tail = coro;
+}
+
+// NOTE: every coroutine starts here, it never returns: once the peer is done it switches back for good
+void
+coro_entry(void) {
+    coro_scheduler_t* scheduler = coro_scheduler;
+    coro_t* coro = scheduler->current;
+
+    scheduler->fn(coro->fd);
+
+    coro->done = true;
+
+    coro_context_switch(&coro->ctx, &scheduler->main_ctx);
+}
+
+// NOTE: the fd must be nonblocking, it's watched until it's closed
+void
+coro_spawn(coro_scheduler_t* scheduler, int fd) {
+    coro_t* coro = (coro_t*) pool_alloc(&scheduler->coros);
+
+    coro->stack = pool_alloc(&scheduler->stacks);
+    coro->fd = fd;
+    coro->waiting = 0;
+    coro->io_calls = 0;
+    coro->done = false;
+
+    coro_context_init(&coro->ctx, coro->stack, CORO_STACK_SIZE, coro_entry);
+
+    struct epoll_event event = {0};
+
+    event.data.ptr = coro;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+
+    if (epoll_ctl(scheduler->epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    scheduler->live++;
+
+    coro_make_runnable(scheduler, coro);
+}
+
+// NOTE: give the cpu back to the scheduler, parked on events or runnable again when events is zero
+void
+coro_yield(uint32_t events) {
+    coro_scheduler_t* scheduler = coro_scheduler;
+    coro_t* coro = scheduler->current;
+
+    coro->waiting = events;
+    coro->io_calls = 0;
+
+    if (events == 0) {
+        coro_make_runnable(scheduler, coro);
+    }
+
+    coro_context_switch(&coro->ctx, &scheduler->main_ctx);
+}
+
+// NOTE: the fd of a parked coroutine became ready
+void
+coro_on_ready(coro_scheduler_t* scheduler, coro_t* coro, uint32_t events) {
+    if (coro->waiting != 0 && (events & (coro->waiting | EPOLLERR | EPOLLHUP))) {
+        coro->waiting = 0;
+
+        coro_make_runnable(scheduler, coro);
+    }
+}
+
+// NOTE: runs every runnable coroutine until it blocks or finishes, the finished ones give their stack back
+void
+coro_run(coro_scheduler_t* scheduler) {
+    while (scheduler->run_head != NULL) {
+        coro_t* coro = scheduler->run_head;
+
+        scheduler->run_head = coro->next;
+
+        if (scheduler->run_head == NULL) {
+            scheduler->run_tail = NULL;
+        }
+
+        scheduler->current = coro;
+
+        coro_context_switch(&scheduler->main_ctx, &coro->ctx);
+
+        scheduler->current = NULL;
+
+        if (coro->done) {
+            pool_release(&scheduler->stacks, coro->stack);
+            pool_release(&scheduler->coros, coro);
+
+            scheduler->live--;
+        }
+    }
+}
+
+// NOTE: counts an I/O call that didn't block, past the budget the coroutine goes to the back of the run queue
+void
+coro_io_done(coro_t* coro) {
+    if (++coro->io_calls >= CORO_IO_BUDGET) {
+        coro_yield(0);
+    }
+}
+
+ssize_t
+coro_recv(int fd, void* buf, size_t len, int flags) {
+    coro_t* coro = coro_self();
+
+    if (coro == NULL) {
+        return recv(fd, buf, len, flags);
+    }
+
+    while (1) {
+        ssize_t recv_len = recv(fd, buf, len, flags);
+
+        if (recv_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            coro_yield(EPOLLIN);
+
+            continue;
+        }
+
+        coro_io_done(coro);
+
+        return recv_len;
+    }
+}
+
+ssize_t
+coro_send(int fd, const void* buf, size_t len, int flags) {
+    coro_t* coro = coro_self();
+
+    if (coro == NULL) {
+        return send(fd, buf, len, flags);
+    }
+
+    while (1) {
+        ssize_t sent_len = send(fd, buf, len, flags | MSG_NOSIGNAL);
+
+        if (sent_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            coro_yield(EPOLLOUT);
+
+            continue;
+        }
+
+        coro_io_done(coro);
+
+        return sent_len;
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef HEADERS_HISTOGRAM_H
+#define HEADERS_HISTOGRAM_H
+
+// NOTE: HDR (high dynamic range) histogram with log-linear buckets. Values below 128 have their own bucket and every
+// power of two above is split in 64 linear sub-buckets, so any value from 1 to 2^64 is recorded in O(1) with a
+// relative error below 1/64 (~1.6%) on a fixed ~30 KB array
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BUCKETS 128
+#define HISTOGRAM_HALF_SUB_BUCKETS 64
+#define HISTOGRAM_BUCKETS (HISTOGRAM_HALF_SUB_BUCKETS * 57 + HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} histogram_t;
+
+void
+histogram_init(histogram_t* histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+
+    histogram->min = UINT64_MAX;
+}
+
+int
+histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int) value;
+    }
+
+    int shift = (63 - __builtin_clzll(value)) - 6;
+
+    return HISTOGRAM_HALF_SUB_BUCKETS * shift + (int) (value >> shift);
+}
+
+// NOTE: highest value that lands on the bucket, the reported percentiles never underestimate
+uint64_t
+histogram_value(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t) index;
+    }
+
+    int shift = index / HISTOGRAM_HALF_SUB_BUCKETS - 1;
+    uint64_t mantissa = (uint64_t) (index - HISTOGRAM_HALF_SUB_BUCKETS * shift);
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void
+histogram_record(histogram_t* histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)]++;
+    histogram->total++;
+
+    if (value < histogram->min) {
+        histogram->min = value;
+    }
+
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+void
+histogram_merge(histogram_t* dst, const histogram_t* src) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+
+    dst->total += src->total;
+
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t
+histogram_percentile(const histogram_t* histogram, double percentile) {
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t) (percentile / 100.0 * histogram->total + 0.5);
+    uint64_t seen = 0;
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+
+        if (seen >= target) {
+            uint64_t value = histogram_value(i);
+
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+// NOTE: percentile distribution on the HdrHistogram text format (.hgrm), the values are divided by scale
+void
+histogram_print(const histogram_t* histogram, FILE* out, double scale) {
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    uint64_t seen = 0;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS && seen < histogram->total; i++) {
+        if (histogram->counts[i] == 0) {
+            continue;
+        }
+
+        seen += histogram->counts[i];
+
+        double percentile = (double) seen / histogram->total;
+        uint64_t value = histogram_value(i) < histogram->max ? histogram_value(i) : histogram->max;
+
+        if (seen < histogram->total) {
+            fprintf(out, "%12.3f %14.12f %10lu %14.2f\n", value / scale, percentile, seen, 1.0 / (1.0 - percentile));
+        } else {
+            fprintf(out, "%12.3f %14.12f %10lu\n", value / scale, percentile, seen);
+        }
+    }
+
+    fprintf(out, "#[Max = %12.3f, Total count = %12lu]\n", histogram->max / scale, histogram->total);
+}
+
+#endif
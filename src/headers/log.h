@@ -0,0 +1,246 @@
+#ifndef HEADERS_LOG_H
+#define HEADERS_LOG_H
+
+// NOTE: asynchronous logging, the loops never write to a stream. A message is formatted by the caller into a slot of a
+// bounded lock-free MPSC ring (Vyukov): a producer claims the slot with a CAS on the tail and publishes it by bumping
+// the slot sequence, a full ring drops the message and counts it instead of blocking. A flusher thread drains the ring
+// in batches to stdout (stderr from warn up) and flushes once per batch, so a slow consumer of the output only costs
+// dropped lines. Before log_start, and after the flusher is stopped, the messages are written right away
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+
+#define LOG_RING_SIZE 4096
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_MSG_SIZE 240
+// NOTE: how long the flusher sleeps on an empty ring
+#define LOG_FLUSH_INTERVAL_MS 5
+
+typedef enum { LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR } log_level_t;
+
+typedef struct {
+    // NOTE: equals the ticket of the producer that may fill the slot, ticket + 1 once the message is published
+    uint64_t seq;
+    log_level_t level;
+    uint32_t len;
+    char msg[LOG_MSG_SIZE];
+} log_slot_t;
+
+typedef struct {
+    log_slot_t slots[LOG_RING_SIZE];
+    // NOTE: producers and consumer on different cache lines
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    uint64_t dropped_reported;
+} log_ring_t;
+
+static log_level_t log_level = LOG_LEVEL_INFO;
+static log_ring_t* log_ring = NULL;
+static bool log_running = false;
+// NOTE: the flusher is the only consumer, the drain at exit takes the lock from it
+static pthread_mutex_t log_consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+FILE*
+log_stream(log_level_t level) {
+    return level >= LOG_LEVEL_WARN ? stderr : stdout;
+}
+
+// NOTE: debug, info, warn or error. Returns false on an unknown name
+bool
+log_parse_level(const char* name, log_level_t* level) {
+    const char* names[] = {"debug", "info", "warn", "error"};
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (log_level_t) i;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+log_enabled(log_level_t level) {
+    return level >= log_level;
+}
+
+void
+log_write(log_level_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void
+log_write(log_level_t level, const char* fmt, ...) {
+    if (!log_enabled(level)) {
+        return;
+    }
+
+    va_list args;
+
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        FILE* out = log_stream(level);
+
+        va_start(args, fmt);
+        vfprintf(out, fmt, args);
+        va_end(args);
+
+        fputc('\n', out);
+
+        return;
+    }
+
+    log_ring_t* ring = log_ring;
+    uint64_t ticket = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    log_slot_t* slot;
+
+    while (1) {
+        slot = &ring->slots[ticket & LOG_RING_MASK];
+
+        int64_t diff = (int64_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - ticket);
+
+        if (diff == 0) {
+            bool claimed =
+                __atomic_compare_exchange_n(&ring->tail, &ticket, ticket + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+            if (claimed) {
+                break;
+            }
+        } else if (diff < 0) {
+            // NOTE: the slot still holds a message of the previous lap, the ring is full
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+
+            return;
+        } else {
+            ticket = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_start(args, fmt);
+    int len = vsnprintf(slot->msg, LOG_MSG_SIZE, fmt, args);
+    va_end(args);
+
+    slot->level = level;
+    slot->len = len < 0 ? 0 : (len >= LOG_MSG_SIZE ? LOG_MSG_SIZE - 1 : (uint32_t) len);
+
+    __atomic_store_n(&slot->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// NOTE: writes every published message, returns how many. A slot claimed but not published yet stops the drain, the
+// next one picks up from it
+size_t
+log_drain(log_ring_t* ring) {
+    size_t drained = 0;
+
+    pthread_mutex_lock(&log_consumer_lock);
+
+    while (1) {
+        uint64_t head = ring->head;
+        log_slot_t* slot = &ring->slots[head & LOG_RING_MASK];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1) {
+            break;
+        }
+
+        FILE* out = log_stream(slot->level);
+
+        fwrite(slot->msg, 1, slot->len, out);
+        fputc('\n', out);
+
+        // NOTE: hand the slot over to the producer of the next lap
+        __atomic_store_n(&slot->seq, head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+
+        ring->head = head + 1;
+        drained++;
+    }
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+    if (dropped != ring->dropped_reported) {
+        fprintf(stderr, "log: %lu messages dropped\n", dropped - ring->dropped_reported);
+
+        ring->dropped_reported = dropped;
+    }
+
+    pthread_mutex_unlock(&log_consumer_lock);
+
+    if (drained > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    return drained;
+}
+
+void*
+log_flusher(void* arg) {
+    log_ring_t* ring = (log_ring_t*) arg;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000000};
+
+    while (1) {
+        if (log_drain(ring) == 0) {
+            // NOTE: also what was printed straight to the streams, like the startup messages
+            fflush(stdout);
+
+            nanosleep(&interval, NULL);
+        }
+    }
+
+    return 0;
+}
+
+// NOTE: runs on exit, errlog included, so the last messages aren't lost
+void
+log_stop(void) {
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+
+    log_drain(log_ring);
+}
+
+void
+log_start(void) {
+    log_ring_t* ring;
+
+    if (posix_memalign((void**) &ring, 64, sizeof(log_ring_t)) != 0) {
+        errlog("error to allocate memory");
+    }
+
+    memset(ring, 0, sizeof(*ring));
+
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        ring->slots[i].seq = i;
+    }
+
+    log_ring = ring;
+
+    pthread_t flusher;
+
+    if (pthread_create(&flusher, NULL, log_flusher, ring) != 0) {
+        errlog("error to create the log flusher thread");
+    }
+
+    pthread_detach(flusher);
+
+    atexit(log_stop);
+
+    __atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+}
+
+#endif
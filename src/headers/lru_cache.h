@@ -0,0 +1,212 @@
+#ifndef HEADERS_LRU_CACHE_H
+#define HEADERS_LRU_CACHE_H
+
+// NOTE: bounded cache of uint64_t keys and values, safe to share between threads. The keys are spread over
+// LRU_CACHE_SHARDS shards by hash, each with a lock, a chained hash table and a recency list of its own, so threads
+// only contend when they hit the same shard. The entries live on an array allocated up front and are linked by index,
+// a full shard reuses the least recently used entry and never allocates
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "error.h"
+
+#define LRU_CACHE_SHARDS 16
+#define LRU_NIL -1
+
+typedef struct {
+    uint64_t key;
+    uint64_t value;
+    // NOTE: recency list, most recent first
+    int32_t prev;
+    int32_t next;
+    // NOTE: next entry on the same hash bucket
+    int32_t chain;
+} lru_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    lru_entry_t* entries;
+    int32_t* buckets;
+    uint32_t cap;
+    uint32_t len;
+    uint32_t bucket_mask;
+    int32_t head;
+    int32_t tail;
+} __attribute__((aligned(64))) lru_shard_t;
+
+typedef struct {
+    lru_shard_t shards[LRU_CACHE_SHARDS];
+} lru_cache_t;
+
+uint64_t
+lru_hash(uint64_t key) {
+    return key * 0x9e3779b97f4a7c15ull;
+}
+
+// NOTE: the top bits pick the shard, the middle ones the bucket
+lru_shard_t*
+lru_shard(lru_cache_t* cache, uint64_t hash) {
+    return &cache->shards[hash >> 60];
+}
+
+int32_t*
+lru_bucket(lru_shard_t* shard, uint64_t hash) {
+    return &shard->buckets[(hash >> 24) & shard->bucket_mask];
+}
+
+// NOTE: the capacity is split evenly between the shards
+lru_cache_t*
+lru_cache_create(size_t capacity) {
+    lru_cache_t* cache;
+
+    if (posix_memalign((void**) &cache, 64, sizeof(lru_cache_t)) != 0) {
+        errlog("error to allocate memory");
+    }
+
+    uint32_t cap = capacity / LRU_CACHE_SHARDS > 0 ? capacity / LRU_CACHE_SHARDS : 1;
+    uint32_t nbuckets = 1;
+
+    while (nbuckets < cap) {
+        nbuckets <<= 1;
+    }
+
+    for (int i = 0; i < LRU_CACHE_SHARDS; i++) {
+        lru_shard_t* shard = &cache->shards[i];
+
+        shard->entries = (lru_entry_t*) malloc(cap * sizeof(lru_entry_t));
+        shard->buckets = (int32_t*) malloc(nbuckets * sizeof(int32_t));
+        shard->cap = cap;
+        shard->len = 0;
+        shard->bucket_mask = nbuckets - 1;
+        shard->head = LRU_NIL;
+        shard->tail = LRU_NIL;
+
+        if (shard->entries == NULL || shard->buckets == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        for (uint32_t k = 0; k < nbuckets; k++) {
+            shard->buckets[k] = LRU_NIL;
+        }
+
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            errlog("error to initialize the cache shard lock");
+        }
+    }
+
+    return cache;
+}
+
+void
+lru_unlink(lru_shard_t* shard, int32_t i) {
+    lru_entry_t* entry = &shard->entries[i];
+
+    if (entry->prev != LRU_NIL) {
+        shard->entries[entry->prev].next = entry->next;
+    } else {
+        shard->head = entry->next;
+    }
+
+    if (entry->next != LRU_NIL) {
+        shard->entries[entry->next].prev = entry->prev;
+    } else {
+        shard->tail = entry->prev;
+    }
+}
+
+void
+lru_push_front(lru_shard_t* shard, int32_t i) {
+    lru_entry_t* entry = &shard->entries[i];
+
+    entry->prev = LRU_NIL;
+    entry->next = shard->head;
+
+    if (shard->head != LRU_NIL) {
+        shard->entries[shard->head].prev = i;
+    } else {
+        shard->tail = i;
+    }
+
+    shard->head = i;
+}
+
+int32_t
+lru_find(lru_shard_t* shard, uint64_t hash, uint64_t key) {
+    int32_t i = *lru_bucket(shard, hash);
+
+    while (i != LRU_NIL && shard->entries[i].key != key) {
+        i = shard->entries[i].chain;
+    }
+
+    return i;
+}
+
+// NOTE: a hit becomes the most recent entry of its shard
+bool
+lru_cache_get(lru_cache_t* cache, uint64_t key, uint64_t* value) {
+    uint64_t hash = lru_hash(key);
+    lru_shard_t* shard = lru_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    int32_t i = lru_find(shard, hash, key);
+
+    if (i != LRU_NIL) {
+        *value = shard->entries[i].value;
+
+        lru_unlink(shard, i);
+        lru_push_front(shard, i);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return i != LRU_NIL;
+}
+
+void
+lru_cache_put(lru_cache_t* cache, uint64_t key, uint64_t value) {
+    uint64_t hash = lru_hash(key);
+    lru_shard_t* shard = lru_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    int32_t i = lru_find(shard, hash, key);
+
+    if (i != LRU_NIL) {
+        lru_unlink(shard, i);
+    } else {
+        if (shard->len < shard->cap) {
+            i = shard->len++;
+        } else {
+            // NOTE: evict the least recent entry, it's taken off its bucket chain before the slot is reused
+            i = shard->tail;
+
+            lru_unlink(shard, i);
+
+            int32_t* link = lru_bucket(shard, lru_hash(shard->entries[i].key));
+
+            while (*link != i) {
+                link = &shard->entries[*link].chain;
+            }
+
+            *link = shard->entries[i].chain;
+        }
+
+        int32_t* bucket = lru_bucket(shard, hash);
+
+        shard->entries[i].key = key;
+        shard->entries[i].chain = *bucket;
+        *bucket = i;
+    }
+
+    shard->entries[i].value = value;
+
+    lru_push_front(shard, i);
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef HEADERS_POOL_H
+#define HEADERS_POOL_H
+
+// NOTE: fixed size object pool backed by a free list. Released objects are kept for reuse, so the pool grows up to the
+// peak of objects used at the same time and malloc/free are only hit while it's growing. Past max_free the released
+// objects go back to malloc, the peak reported on the stats is what max_free should be sized from. It isn't
+// thread-safe, each event loop owns its pools
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+
+typedef struct pool_node {
+    struct pool_node* next;
+} pool_node_t;
+
+typedef struct {
+    const char* name;
+    size_t object_size;
+    size_t max_free;
+    pool_node_t* free_list;
+    size_t free_len;
+    size_t in_use;
+    size_t peak_in_use;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t drops;
+} pool_t;
+
+void
+pool_init(pool_t* pool, const char* name, size_t object_size, size_t max_free) {
+    pool->name = name;
+    pool->object_size = object_size < sizeof(pool_node_t) ? sizeof(pool_node_t) : object_size;
+    pool->max_free = max_free;
+    pool->free_list = NULL;
+    pool->free_len = 0;
+    pool->in_use = 0;
+    pool->peak_in_use = 0;
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->drops = 0;
+}
+
+void*
+pool_alloc(pool_t* pool) {
+    void* object;
+
+    if (pool->free_list != NULL) {
+        object = pool->free_list;
+        pool->free_list = pool->free_list->next;
+        pool->free_len--;
+        pool->hits++;
+    } else {
+        object = malloc(pool->object_size);
+
+        if (object == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        pool->misses++;
+    }
+
+    if (++pool->in_use > pool->peak_in_use) {
+        pool->peak_in_use = pool->in_use;
+    }
+
+    return object;
+}
+
+void
+pool_release(pool_t* pool, void* object) {
+    if (object == NULL) {
+        return;
+    }
+
+    pool->in_use--;
+
+    if (pool->free_len >= pool->max_free) {
+        free(object);
+
+        pool->drops++;
+
+        return;
+    }
+
+    pool_node_t* node = (pool_node_t*) object;
+
+    node->next = pool->free_list;
+    pool->free_list = node;
+    pool->free_len++;
+}
+
+void
+pool_destroy(pool_t* pool) {
+    while (pool->free_list != NULL) {
+        pool_node_t* node = pool->free_list;
+
+        pool->free_list = node->next;
+
+        free(node);
+    }
+
+    pool->free_len = 0;
+}
+
+void
+pool_print_stats(const pool_t* pool, FILE* out) {
+    uint64_t total = pool->hits + pool->misses;
+
+    fprintf(out,
+            "pool %-10s size=%-6zu hits=%-10lu misses=%-8lu hit_rate=%6.2f%% drops=%-8lu in_use=%-6zu peak=%-6zu "
+            "free=%zu\n",
+            pool->name,
+            pool->object_size,
+            pool->hits,
+            pool->misses,
+            total > 0 ? 100.0 * pool->hits / total : 0.0,
+            pool->drops,
+            pool->in_use,
+            pool->peak_in_use,
+            pool->free_len);
+}
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef HEADERS_PRIME_H
+#define HEADERS_PRIME_H
+
+// NOTE: the prime checking protocol of the node server (src/index.js): the peer sends numbers, one per line, and gets
+// back "prime\n" or "composite\n" for each of them, in order. Only the leading digits of a line are read, like buf2num
+// on src/utils.js, so a line without digits is 0.
+//
+// the check is split in two: prime_quick_check answers the numbers below PRIME_SIEVE_LIMIT from a sieve and the ones
+// with a small factor by trial division, cheap enough for the event loop. What's left goes to prime_is_prime, a
+// deterministic Miller-Rabin for 64 bits instead of the O(sqrt(n)) trial division of the node server
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// NOTE: the sieve answers every number below it, the primes below PRIME_SMALL_LIMIT prefilter the bigger ones
+#define PRIME_SIEVE_LIMIT 65536
+#define PRIME_SMALL_LIMIT 256
+
+typedef enum { PRIME_COMPOSITE = 0, PRIME_PRIME = 1, PRIME_UNKNOWN = 2 } prime_result_t;
+
+// NOTE: a number split between reads is kept here until its line ends
+typedef struct {
+    uint64_t num;
+    // NOTE: the line had a non digit, the rest of it is skipped
+    bool skipping;
+    bool pending;
+} prime_parser_t;
+
+__extension__ typedef unsigned __int128 prime_uint128_t;
+
+static uint8_t prime_sieve[PRIME_SIEVE_LIMIT];
+static uint32_t prime_small[PRIME_SMALL_LIMIT];
+static int prime_nsmall = 0;
+
+// NOTE: the sieve of Eratosthenes, built once before main()
+__attribute__((constructor)) void
+prime_sieve_init(void) {
+    memset(prime_sieve, 1, sizeof(prime_sieve));
+
+    prime_sieve[0] = 0;
+    prime_sieve[1] = 0;
+
+    for (uint32_t i = 2; i * i < PRIME_SIEVE_LIMIT; i++) {
+        if (prime_sieve[i]) {
+            for (uint32_t k = i * i; k < PRIME_SIEVE_LIMIT; k += i) {
+                prime_sieve[k] = 0;
+            }
+        }
+    }
+
+    for (uint32_t i = 3; i < PRIME_SMALL_LIMIT; i++) {
+        if (prime_sieve[i]) {
+            prime_small[prime_nsmall++] = i;
+        }
+    }
+}
+
+void
+prime_parser_init(prime_parser_t* parser) {
+    parser->num = 0;
+    parser->skipping = false;
+    parser->pending = false;
+}
+
+// NOTE: the digits until the first non digit of a line, saturated on overflow. Writes on nums every line ended on buf,
+// at most one per '\n', and returns how many
+size_t
+prime_parse_batch(prime_parser_t* parser, const uint8_t* buf, size_t len, uint64_t* nums) {
+    size_t nnums = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = buf[i];
+
+        if (c == '\n') {
+            nums[nnums++] = parser->num;
+
+            prime_parser_init(parser);
+        } else if (parser->skipping) {
+            continue;
+        } else if (c >= '0' && c <= '9') {
+            uint64_t digit = c - '0';
+
+            parser->num = parser->num > (UINT64_MAX - digit) / 10 ? UINT64_MAX : parser->num * 10 + digit;
+            parser->pending = true;
+        } else {
+            parser->skipping = true;
+            parser->pending = true;
+        }
+    }
+
+    return nnums;
+}
+
+// NOTE: the peer closed, a last line without '\n' still counts
+bool
+prime_parse_finish(prime_parser_t* parser, uint64_t* num) {
+    bool pending = parser->pending;
+
+    *num = parser->num;
+
+    prime_parser_init(parser);
+
+    return pending;
+}
+
+prime_result_t
+prime_quick_check(uint64_t num) {
+    if (num < PRIME_SIEVE_LIMIT) {
+        return prime_sieve[num] ? PRIME_PRIME : PRIME_COMPOSITE;
+    }
+
+    if (num % 2 == 0) {
+        return PRIME_COMPOSITE;
+    }
+
+    for (int i = 0; i < prime_nsmall; i++) {
+        if (num % prime_small[i] == 0) {
+            return PRIME_COMPOSITE;
+        }
+    }
+
+    return PRIME_UNKNOWN;
+}
+
+uint64_t
+prime_mulmod(uint64_t a, uint64_t b, uint64_t mod) {
+    return (uint64_t) ((prime_uint128_t) a * b % mod);
+}
+
+uint64_t
+prime_powmod(uint64_t base, uint64_t exp, uint64_t mod) {
+    uint64_t result = 1;
+
+    base %= mod;
+
+    while (exp > 0) {
+        if (exp & 1) {
+            result = prime_mulmod(result, base, mod);
+        }
+
+        base = prime_mulmod(base, base, mod);
+        exp >>= 1;
+    }
+
+    return result;
+}
+
+// NOTE: odd num past the sieve. These seven bases are a witness for every composite below 2^64 (Jim Sinclair), so the
+// answer is exact
+bool
+prime_miller_rabin(uint64_t num) {
+    static const uint64_t bases[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+
+    uint64_t d = num - 1;
+    int s = __builtin_ctzll(d);
+
+    d >>= s;
+
+    for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++) {
+        uint64_t a = bases[i] % num;
+
+        if (a == 0) {
+            continue;
+        }
+
+        uint64_t x = prime_powmod(a, d, num);
+
+        if (x == 1 || x == num - 1) {
+            continue;
+        }
+
+        bool witness = true;
+
+        for (int r = 1; r < s && witness; r++) {
+            x = prime_mulmod(x, x, num);
+            witness = x != num - 1;
+        }
+
+        if (witness) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+prime_is_prime(uint64_t num) {
+    prime_result_t result = prime_quick_check(num);
+
+    if (result != PRIME_UNKNOWN) {
+        return result == PRIME_PRIME;
+    }
+
+    return prime_miller_rabin(num);
+}
+
+const char*
+prime_response(bool prime) {
+    return prime ? "prime\n" : "composite\n";
+}
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef HEADERS_SEND_QUEUE_H
+#define HEADERS_SEND_QUEUE_H
+
+// NOTE: per-peer output queue made of chained chunks, it grows while the peer doesn't drain its socket and gives the
+// memory back as soon as a chunk is sent. The servers stop reading from a peer whose queue passes the high watermark
+// and resume once it drains below the low watermark, so a slow consumer can't bloat the process.
+//
+// with zerocopy enabled the kernel transmits straight from the chunks (MSG_ZEROCOPY or io_uring SEND_ZC), a sent chunk
+// is then retired instead of released and only freed once the kernel reports it's done with every send that used it
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "error.h"
+
+#define SEND_CHUNK_SIZE 4096
+#define SEND_QUEUE_MAX_IOV 16
+
+typedef struct send_chunk {
+    struct send_chunk* next;
+    size_t start;
+    size_t end;
+    size_t size;
+    // NOTE: last zerocopy send that read from the chunk
+    uint32_t zerocopy_id;
+    bool zerocopy;
+    uint8_t data[];
+} send_chunk_t;
+
+typedef struct {
+    uint32_t first_id;
+    uint32_t last_id;
+} send_zerocopy_range_t;
+
+// NOTE: zerocopy sends are numbered in the order they are issued, the same way the kernel numbers the MSG_ZEROCOPY
+// notifications of a socket
+typedef struct {
+    send_chunk_t* retired_head;
+    send_chunk_t* retired_tail;
+    uint32_t next_id;
+    // NOTE: every send below this id is completed
+    uint32_t done_id;
+    // NOTE: completed ranges past a send still in use, merged into done_id once the gap is completed
+    send_zerocopy_range_t* ahead;
+    int ahead_len;
+    int ahead_cap;
+} send_zerocopy_t;
+
+typedef struct {
+    send_chunk_t* head;
+    send_chunk_t* tail;
+    size_t len;
+    // NOTE: only allocated for the peers with zerocopy enabled
+    send_zerocopy_t* zerocopy;
+} send_queue_t;
+
+static size_t send_queue_high_watermark = 64 * 1024;
+static size_t send_queue_low_watermark = 16 * 1024;
+// NOTE: smaller sends are copied, pinning the pages and waiting for a notification costs more than copying a few KB.
+// Zero disables zerocopy
+static size_t send_queue_zerocopy_threshold = 0;
+
+void
+send_queue_init(send_queue_t* queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->len = 0;
+    queue->zerocopy = NULL;
+}
+
+void
+send_queue_enable_zerocopy(send_queue_t* queue) {
+    if (queue->zerocopy != NULL) {
+        return;
+    }
+
+    queue->zerocopy = (send_zerocopy_t*) calloc(1, sizeof(send_zerocopy_t));
+
+    if (queue->zerocopy == NULL) {
+        errlog("error to allocate memory");
+    }
+}
+
+// NOTE: wrap-around safe comparison of zerocopy ids
+bool
+send_zerocopy_is_done(const send_zerocopy_t* zerocopy, uint32_t id) {
+    return (int32_t) (id - zerocopy->done_id) < 0;
+}
+
+// NOTE: true while a zerocopy send isn't reported completed yet, the kernel may still read its chunks
+bool
+send_queue_zerocopy_pending(const send_queue_t* queue) {
+    return queue->zerocopy != NULL && queue->zerocopy->done_id != queue->zerocopy->next_id;
+}
+
+void
+send_queue_append(send_queue_t* queue, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        send_chunk_t* tail = queue->tail;
+
+        if (tail == NULL || tail->end == tail->size) {
+            size_t size = len > SEND_CHUNK_SIZE ? len : SEND_CHUNK_SIZE;
+
+            tail = (send_chunk_t*) malloc(sizeof(send_chunk_t) + size);
+
+            if (tail == NULL) {
+                errlog("error to allocate memory");
+            }
+
+            tail->next = NULL;
+            tail->start = 0;
+            tail->end = 0;
+            tail->size = size;
+            tail->zerocopy = false;
+
+            if (queue->tail == NULL) {
+                queue->head = tail;
+            } else {
+                queue->tail->next = tail;
+            }
+
+            queue->tail = tail;
+        }
+
+        size_t copy_len = tail->size - tail->end < len ? tail->size - tail->end : len;
+
+        memcpy(&tail->data[tail->end], data, copy_len);
+
+        tail->end += copy_len;
+        queue->len += copy_len;
+        data += copy_len;
+        len -= copy_len;
+    }
+}
+
+// NOTE: describe the pending bytes as an iovec array (writev/sendmsg), returns how many entries were filled
+int
+send_queue_iov(const send_queue_t* queue, struct iovec* iov, int max_iov) {
+    int iov_len = 0;
+
+    for (send_chunk_t* chunk = queue->head; chunk != NULL && iov_len < max_iov; chunk = chunk->next) {
+        iov[iov_len].iov_base = &chunk->data[chunk->start];
+        iov[iov_len].iov_len = chunk->end - chunk->start;
+        iov_len++;
+    }
+
+    return iov_len;
+}
+
+// NOTE: the first iov_len chunks were just passed to a zerocopy send
+void
+send_queue_zerocopy_sent(send_queue_t* queue, int iov_len) {
+    send_zerocopy_t* zerocopy = queue->zerocopy;
+    send_chunk_t* chunk = queue->head;
+
+    for (int i = 0; i < iov_len && chunk != NULL; i++, chunk = chunk->next) {
+        chunk->zerocopy = true;
+        chunk->zerocopy_id = zerocopy->next_id;
+    }
+
+    zerocopy->next_id++;
+}
+
+// NOTE: the sends first_id..last_id (inclusive) are completed, the kernel coalesces consecutive notifications in one
+// range. A range past a send still in use is kept aside until the gap is completed. The retired chunks are released in
+// order up to the first one still in use
+void
+send_queue_zerocopy_completed(send_queue_t* queue, uint32_t first_id, uint32_t last_id) {
+    send_zerocopy_t* zerocopy = queue->zerocopy;
+
+    if ((int32_t) (first_id - zerocopy->done_id) > 0) {
+        if (zerocopy->ahead_len == zerocopy->ahead_cap) {
+            int cap = zerocopy->ahead_cap > 0 ? zerocopy->ahead_cap * 2 : 4;
+            send_zerocopy_range_t* ahead =
+                (send_zerocopy_range_t*) realloc(zerocopy->ahead, cap * sizeof(send_zerocopy_range_t));
+
+            if (ahead == NULL) {
+                errlog("error to allocate memory");
+            }
+
+            zerocopy->ahead = ahead;
+            zerocopy->ahead_cap = cap;
+        }
+
+        zerocopy->ahead[zerocopy->ahead_len++] = (send_zerocopy_range_t) {.first_id = first_id, .last_id = last_id};
+    } else if (!send_zerocopy_is_done(zerocopy, last_id)) {
+        zerocopy->done_id = last_id + 1;
+
+        // NOTE: the ranges kept aside are few, rescanned until none touches done_id anymore
+        for (int i = 0; i < zerocopy->ahead_len;) {
+            send_zerocopy_range_t range = zerocopy->ahead[i];
+
+            if ((int32_t) (range.first_id - zerocopy->done_id) > 0) {
+                i++;
+
+                continue;
+            }
+
+            zerocopy->ahead[i] = zerocopy->ahead[--zerocopy->ahead_len];
+
+            if (!send_zerocopy_is_done(zerocopy, range.last_id)) {
+                zerocopy->done_id = range.last_id + 1;
+                i = 0;
+            }
+        }
+    }
+
+    while (zerocopy->retired_head != NULL && send_zerocopy_is_done(zerocopy, zerocopy->retired_head->zerocopy_id)) {
+        send_chunk_t* chunk = zerocopy->retired_head;
+
+        zerocopy->retired_head = chunk->next;
+
+        if (zerocopy->retired_head == NULL) {
+            zerocopy->retired_tail = NULL;
+        }
+
+        free(chunk);
+    }
+}
+
+void
+send_queue_release_chunk(send_queue_t* queue, send_chunk_t* chunk) {
+    send_zerocopy_t* zerocopy = queue->zerocopy;
+
+    if (zerocopy == NULL || !chunk->zerocopy || send_zerocopy_is_done(zerocopy, chunk->zerocopy_id)) {
+        free(chunk);
+
+        return;
+    }
+
+    chunk->next = NULL;
+
+    if (zerocopy->retired_tail == NULL) {
+        zerocopy->retired_head = chunk;
+    } else {
+        zerocopy->retired_tail->next = chunk;
+    }
+
+    zerocopy->retired_tail = chunk;
+}
+
+void
+send_queue_consume(send_queue_t* queue, size_t len) {
+    assert(len <= queue->len);
+
+    queue->len -= len;
+
+    while (len > 0) {
+        send_chunk_t* head = queue->head;
+        size_t chunk_len = head->end - head->start;
+
+        if (len < chunk_len) {
+            head->start += len;
+
+            return;
+        }
+
+        len -= chunk_len;
+        queue->head = head->next;
+
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+
+        send_queue_release_chunk(queue, head);
+    }
+}
+
+// NOTE: also drops the zerocopy state, the socket must not be used for zerocopy sends anymore. The retired chunks are
+// released right away, the caller makes sure the kernel is done with them first (see send_queue_zerocopy_pending)
+void
+send_queue_clear(send_queue_t* queue) {
+    send_zerocopy_t* zerocopy = queue->zerocopy;
+
+    queue->zerocopy = NULL;
+
+    send_queue_consume(queue, queue->len);
+
+    if (zerocopy != NULL) {
+        while (zerocopy->retired_head != NULL) {
+            send_chunk_t* chunk = zerocopy->retired_head;
+
+            zerocopy->retired_head = chunk->next;
+
+            free(chunk);
+        }
+
+        free(zerocopy->ahead);
+        free(zerocopy);
+    }
+}
+
+#endif
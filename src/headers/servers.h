@@ -4,25 +4,39 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <uv.h>
 
 #include "error.h"
+#include "log.h"
+#include "pool.h"
+#include "send_queue.h"
+#include "spsc_queue.h"
 #include "state_machine.h"
+#include "stats.h"
+#include "trace.h"
+#include "timer_wheel.h"
 
 #define UNUSED(param) (void) (param);
 #define N_BACKLOG 64
-#define MAXFDS 16 * 1024
-#define SEND_BUF_SIZE 1024
+#define ACCEPT_BUDGET 64
+#define PEER_TABLE_PAGE_SIZE 1024
+#define RECV_BUF_SIZE 16 * 1024
+#define UV_POOL_MAX_FREE 4096
+#define UV_READ_BUF_POOL_MAX_FREE 64
 typedef struct {
     int sockfd;
 } thread_config_t;
@@ -30,15 +44,55 @@ typedef struct {
 typedef struct {
     bool want_read;
     bool want_write;
+    // NOTE: the socket returned EAGAIN, edge-triggered loops stop draining it until the next edge
+    bool would_block;
 } fd_status_t;
 
+// NOTE: the fields are ordered to pack the whole peer on a single 64 bytes cache line, the send buffers are only
+// allocated by the send queue while the peer has pending output
 typedef struct {
     ProcessingState state;
-    uint8_t send_buf[SEND_BUF_SIZE];
-    int send_buf_end;
-    int send_ptr;
+    // NOTE: framed protocol usage, where the peer is on the current frame
+    frame_state_t frame;
+    send_queue_t send_queue;
     // NOTE: libuv usage
     uv_tcp_t* client;
+    // NOTE: a peer is only served by one family, epoll or libuv
+    __extension__ union {
+        // NOTE: epoll usage, the interest mask registered on the queue
+        uint32_t epoll_events;
+        // NOTE: libuv usage
+        uint32_t write_inflight;
+    };
+    // NOTE: io_uring usage, the buffer ids fit in 16 bits
+    int16_t pending_head;
+    int16_t pending_tail;
+    int8_t inflight;
+    // NOTE: reading is paused while the send queue is above the high watermark
+    bool read_paused : 1;
+    // NOTE: the peer finished sending, the connection closes once the pending output is flushed
+    bool read_closed : 1;
+    // NOTE: epoll usage, the readiness seen on edge-triggered mode
+    bool readable : 1;
+    bool writable : 1;
+    // NOTE: epoll usage, the peer is closed and only waits for its zerocopy notifications
+    bool zerocopy_draining : 1;
+    // NOTE: io_uring usage
+    bool recv_armed : 1;
+    bool recv_cancelling : 1;
+    // NOTE: io_uring usage, the recv ended on an empty buffer ring and waits for buffers to be given back
+    bool recv_starved : 1;
+    bool send_inflight : 1;
+    bool closing : 1;
+    // NOTE: libuv usage
+    bool stop_loop : 1;
+    // NOTE: timeouts, the fd has an entry on the timer wheel (at most one) and the peer on it is timed
+    bool timer_queued : 1;
+    bool timer_active : 1;
+    // NOTE: io_uring usage, the received buffers on the pending chain
+    uint8_t pending_len;
+    // NOTE: tick of the last progress on the connection, the deadline is only computed from it when the timer fires
+    uint32_t last_active;
 } peer_state_t;
 
 static struct {
@@ -46,31 +100,154 @@ static struct {
     fd_status_t WRITE;
     fd_status_t READ_WRITE;
     fd_status_t NO_READ_WRITE;
+    fd_status_t READ_BLOCKED;
+    fd_status_t WRITE_BLOCKED;
 } fd_status_mode_t = {
     .READ = {.want_read = true, .want_write = false},
     .WRITE = {.want_read = false, .want_write = true},
     .READ_WRITE = {.want_read = true, .want_write = true},
     .NO_READ_WRITE = {.want_read = false, .want_write = false},
+    .READ_BLOCKED = {.want_read = true, .want_write = false, .would_block = true},
+    .WRITE_BLOCKED = {.want_read = false, .want_write = true, .would_block = true},
 };
 
-// each peer is globally identified by the file descriptor (fd) it's connected
-// on. As long as the peer is connected, the fd is unique to it. When a peer
+// each peer is identified by the file descriptor (fd) it's connected on. As
+// long as the peer is connected, the fd is unique to it. When a peer
 // disconnects, a new peer may connect and get the same fd. on_peer_connected
 // should initialize the state properly to remove any trace of the old peer on
-// the same fd
-static peer_state_t global_state[MAXFDS];
+// the same fd.
+//
+// the table is owned by a single event loop, every reactor thread creates its
+// own so peer state is never shared between threads. The peers are stored on
+// pages of PEER_TABLE_PAGE_SIZE entries allocated on the first fd that lands on
+// them, so an idle server costs nothing and any fd the process can open fits
+typedef struct {
+    peer_state_t** pages;
+    int npages;
+    // NOTE: timeouts of the loop peers, NULL when the loop doesn't run them
+    timer_wheel_t* timers;
+    // NOTE: tick the loop woke up at, peers record their progress with it
+    uint32_t now;
+} peer_table_t;
+
+// NOTE: zero disables the timeout, see peer_timeout_ms
+static uint32_t peer_idle_timeout_ms = 60 * 1000;
+static uint32_t peer_read_timeout_ms = 10 * 1000;
+static uint32_t peer_write_timeout_ms = 30 * 1000;
+
+// NOTE: listen backlog of the servers, the kernel caps it to net.core.somaxconn
+static int listen_backlog = N_BACKLOG;
+// NOTE: seconds the kernel holds a connection until the peer sends something (TCP_DEFER_ACCEPT), zero disables. The
+// server speaks first on this protocol ('*'), so it only saves a wakeup with clients that don't wait for the ack
+static int tcp_defer_accept_secs = 0;
+
+// NOTE: a connection taken from the listening socket by accept_peers, already nonblocking and close-on-exec
+typedef struct {
+    int sockfd;
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+} accepted_peer_t;
+
+// NOTE: connections accepted by another thread and handed over to an event loop, see
+// event_driven_epoll_acceptor_server.c. The eventfd wakes the loop up when the queue stops being empty
+typedef struct {
+    spsc_queue_t queue;
+    int eventfd;
+    // NOTE: stats block of the loop, published once the loop registered it. Its closes tell the acceptor how many of
+    // the peers handed over are still served
+    thread_stats_t* stats;
+} peer_inbox_t;
 
 void sequential_server(int sockfd);
 void thread_server(int sockfd);
+void thread_pool_server(int sockfd, int nthreads);
 void event_driven_select_server(int sockfd);
+void event_driven_poll_server(int sockfd);
 void event_driven_epoll_server(int sockfd);
-int event_driven_libuv_server(int port);
+void event_driven_uring_server(int sockfd);
+void event_driven_epoll_reactor_server(int port, int nreactors);
+void event_driven_epoll_et_server(int sockfd);
+void coroutine_server(int port, int nthreads);
+void prime_epoll_server(int sockfd, int nworkers);
+int prime_libuv_server(int port, int nworkers);
+void event_driven_epoll_acceptor_server(int sockfd, int nworkers);
+void epoll_event_loop(int sockfd, peer_table_t* peer_table, bool edge_triggered, peer_inbox_t* inbox);
+int event_driven_libuv_server(int port, int nloops);
+
+fd_status_t on_peer_data(peer_state_t* peer_state, uint8_t* buf, int len);
+fd_status_t on_peer_data_sent(peer_state_t* peer_state, int sent_len);
 
 void blocking_sock_connection(int sockfd);
 void nonblocking_sock_connection(int sockfd);
 
+peer_table_t*
+peer_table_create(void) {
+    peer_table_t* peer_table = (peer_table_t*) malloc(sizeof(*peer_table));
+
+    if (peer_table == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    peer_table->pages = NULL;
+    peer_table->npages = 0;
+    peer_table->timers = NULL;
+    peer_table->now = 0;
+
+    return peer_table;
+}
+
+peer_state_t*
+peer_table_page_create(peer_table_t* peer_table, int npage) {
+    if (npage >= peer_table->npages) {
+        int npages = peer_table->npages > 0 ? peer_table->npages : 16;
+
+        while (npages <= npage) {
+            npages *= 2;
+        }
+
+        peer_state_t** pages = (peer_state_t**) realloc(peer_table->pages, npages * sizeof(peer_state_t*));
+
+        if (pages == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        memset(&pages[peer_table->npages], 0, (npages - peer_table->npages) * sizeof(peer_state_t*));
+
+        peer_table->pages = pages;
+        peer_table->npages = npages;
+    }
+
+    void* page;
+
+    if (posix_memalign(&page, 64, PEER_TABLE_PAGE_SIZE * sizeof(peer_state_t)) != 0) {
+        errlog("error to allocate memory");
+    }
+
+    memset(page, 0, PEER_TABLE_PAGE_SIZE * sizeof(peer_state_t));
+
+    peer_table->pages[npage] = (peer_state_t*) page;
+
+    return peer_table->pages[npage];
+}
+
+peer_state_t*
+peer_table_get(peer_table_t* peer_table, int sockfd) {
+    assert(sockfd >= 0);
+
+    int npage = sockfd / PEER_TABLE_PAGE_SIZE;
+    peer_state_t* page = npage < peer_table->npages ? peer_table->pages[npage] : NULL;
+
+    if (page == NULL) {
+        page = peer_table_page_create(peer_table, npage);
+    }
+
+    return &page[sockfd % PEER_TABLE_PAGE_SIZE];
+}
+
+// NOTE: with reuseport every reactor binds its own listening socket on the same port and the kernel balances the
+// incoming connections between them
 int
-listen_inet_socket(int port) {
+listen_inet_socket(int port, bool reuseport) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
     if (sockfd == -1) {
@@ -83,6 +260,10 @@ listen_inet_socket(int port) {
         errlog("error to set socket options");
     }
 
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        errlog("error to set socket reuseport option");
+    }
+
     struct sockaddr_in serv_addr;
 
     memset(&serv_addr, 0, sizeof(serv_addr));
@@ -95,22 +276,35 @@ listen_inet_socket(int port) {
         errlog("error to bind socket");
     }
 
-    if (listen(sockfd, N_BACKLOG) == -1) {
+    if (tcp_defer_accept_secs > 0
+        && setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &tcp_defer_accept_secs, sizeof(tcp_defer_accept_secs))
+               == -1) {
+        errlog("error to set socket defer accept option");
+    }
+
+    if (listen(sockfd, listen_backlog) == -1) {
         errlog("error on listen socket");
     }
 
     return sockfd;
 }
 
+// NOTE: numeric only, resolving the peer name would block the loop on a reverse DNS lookup
 void
 log_peer_connection(const struct sockaddr_in* sa, socklen_t salen) {
+    if (!log_enabled(LOG_LEVEL_INFO)) {
+        return;
+    }
+
     char hostbuf[NI_MAXHOST];
     char portbuf[NI_MAXSERV];
 
-    if (getnameinfo((struct sockaddr*) sa, salen, hostbuf, NI_MAXHOST, portbuf, NI_MAXSERV, 0) == 0) {
-        printf("peer '%s:%s' connected\n", hostbuf, portbuf);
+    int flags = NI_NUMERICHOST | NI_NUMERICSERV;
+
+    if (getnameinfo((struct sockaddr*) sa, salen, hostbuf, NI_MAXHOST, portbuf, NI_MAXSERV, flags) == 0) {
+        log_info("peer '%s:%s' connected", hostbuf, portbuf);
     } else {
-        printf("peer 'unknown' connected\n");
+        log_info("peer 'unknown' connected");
     }
 }
 
@@ -124,11 +318,11 @@ start_thread(void* arg) {
 
     unsigned long id = (unsigned long) pthread_self();
 
-    printf("thread %lu created to handle connection with socket %d\n", id, sockfd);
+    log_info("thread %lu created to handle connection with socket %d", id, sockfd);
 
     start_state_machine(sockfd);
 
-    printf("thread %lu done\n", id);
+    log_info("thread %lu done", id);
 
     return 0;
 }
@@ -146,265 +340,849 @@ make_sock_nonblocking(int sockfd) {
     }
 }
 
+// NOTE: every thread that accepts keeps an fd in reserve for when the process runs out of them (EMFILE/ENFILE). The
+// connections left on the backlog would keep the listening socket ready, so a level-triggered loop or the acceptor
+// would spin on it until a peer closes. The reserve is given up to accept them one at a time and close them at once
+static __thread int accept_reserve_fd = -1;
+
+// NOTE: lazily on the first accept of the thread, a failure only leaves the thread without a reserve
+void
+accept_reserve_init(void) {
+    if (accept_reserve_fd == -1) {
+        accept_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+}
+
+// NOTE: returns false when there's nothing left to refuse, accept4 reports EMFILE before it looks at the backlog so
+// the drain is only seen here. Also false when the reserve couldn't be taken back, the connections then stay on the
+// backlog
+bool
+accept_shed_peer(int sockfd, bool* drained) {
+    close(accept_reserve_fd);
+
+    int fd = accept(sockfd, NULL, NULL);
+
+    if (fd != -1) {
+        close(fd);
+    } else {
+        *drained = errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    accept_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    stats_add(&stats_current->syscalls, fd != -1 ? 4 : 3);
+
+    return !*drained && accept_reserve_fd != -1;
+}
+
+// NOTE: accepts up to budget connections in a row, one accept4 per connection instead of an accept plus two fcntl, and
+// returns how many were filled on peers. drained is set once the backlog is empty, otherwise the loop must come back
+// for the rest: a level-triggered listener is reported again, an edge-triggered one isn't. Running out of fds refuses
+// the connections waiting (see accept_reserve_fd), running out of memory leaves them on the backlog
+int
+accept_peers(int sockfd, accepted_peer_t* peers, int budget, bool* drained) {
+    int accepted = 0;
+    int refused = 0;
+
+    *drained = false;
+
+    accept_reserve_init();
+
+    while (accepted + refused < budget) {
+        accepted_peer_t* peer = &peers[accepted];
+
+        peer->addr_len = sizeof(peer->addr);
+        peer->sockfd = accept4(sockfd, (struct sockaddr*) &peer->addr, &peer->addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        stats_add(&stats_current->syscalls, 1);
+
+        if (peer->sockfd != -1) {
+            accepted++;
+
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            *drained = true;
+
+            break;
+        } else if (errno == EINTR || errno == ECONNABORTED) {
+            // NOTE: the peer gave up while on the backlog, go for the next one
+            continue;
+        } else if ((errno == EMFILE || errno == ENFILE) && accept_reserve_fd != -1) {
+            if (refused++ == 0) {
+                log_error("%s:%d: error to accept socket connection, refusing it: %s", __FILE__, __LINE__,
+                          strerror(errno));
+            }
+
+            if (!accept_shed_peer(sockfd, drained)) {
+                break;
+            }
+        } else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            log_error("%s:%d: error to accept socket connection: %s", __FILE__, __LINE__, strerror(errno));
+
+            break;
+        } else {
+            errlog("error to accept socket connection");
+        }
+    }
+
+    return accepted;
+}
+
+void
+peer_inbox_init(peer_inbox_t* inbox, uint64_t cap) {
+    spsc_queue_init(&inbox->queue, sizeof(accepted_peer_t), cap);
+
+    inbox->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    inbox->stats = NULL;
+
+    if (inbox->eventfd == -1) {
+        errlog("error to create the inbox eventfd");
+    }
+}
+
+// NOTE: producer side, returns false when the inbox is full and the peer must go somewhere else
+bool
+peer_inbox_push(peer_inbox_t* inbox, const accepted_peer_t* peer) {
+    bool was_empty;
+
+    if (!spsc_queue_push(&inbox->queue, peer, &was_empty)) {
+        return false;
+    }
+
+    if (was_empty) {
+        uint64_t one = 1;
+
+        stats_add(&stats_current->syscalls, 1);
+
+        if (write(inbox->eventfd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            errlog("error to write the inbox eventfd");
+        }
+    }
+
+    return true;
+}
+
+// NOTE: the loop side of accept_peers, takes up to budget peers from the inbox. drained is set once it's empty,
+// otherwise the loop must come back for the rest without waiting for the eventfd
+int
+peer_inbox_take(peer_inbox_t* inbox, accepted_peer_t* peers, int budget, bool* drained) {
+    uint64_t count;
+
+    // NOTE: reset before the queue is read, a peer pushed meanwhile is either taken below or found the queue empty and
+    // writes the eventfd again
+    if (read(inbox->eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        errlog("error to read the inbox eventfd");
+    }
+
+    stats_add(&stats_current->syscalls, 1);
+
+    int taken = 0;
+
+    *drained = false;
+
+    while (taken < budget) {
+        if (!spsc_queue_pop(&inbox->queue, &peers[taken])) {
+            *drained = true;
+
+            break;
+        }
+
+        taken++;
+    }
+
+    return taken;
+}
+
+// NOTE: what the loop should wait for, derived from the peer state
 fd_status_t
-on_peer_connected(int sockfd, const struct sockaddr_in* peer_addr, socklen_t peer_addr_len) {
-    assert(sockfd < MAXFDS);
+peer_status(peer_state_t* peer_state) {
+    bool want_write = peer_state->send_queue.len > 0;
+
+    if (peer_state->read_closed) {
+        return want_write ? fd_status_mode_t.WRITE : fd_status_mode_t.NO_READ_WRITE;
+    }
+
+    return (fd_status_t) {
+        .want_read = peer_state->state != INITIAL_ACK && !peer_state->read_paused,
+        .want_write = want_write,
+    };
+}
+
+bool
+peer_timeouts_enabled(void) {
+    return peer_idle_timeout_ms > 0 || peer_read_timeout_ms > 0 || peer_write_timeout_ms > 0;
+}
+
+// NOTE: how long the peer may go without progress, according to what it's waiting for: its output to drain (write),
+// the rest of a message (read) or a new message (idle)
+uint32_t
+peer_timeout_ms(peer_state_t* peer_state) {
+    if (peer_state->send_queue.len > 0 || peer_state->zerocopy_draining) {
+        return peer_write_timeout_ms;
+    }
+
+    return in_message(peer_state->state, peer_state->frame) ? peer_read_timeout_ms : peer_idle_timeout_ms;
+}
+
+// NOTE: the timer is armed to the deadline of the current state, but no further than the shortest timeout from now. The
+// state may move to a shorter timeout before the deadline (an idle peer starting a message) and the wheel isn't told
+uint32_t
+peer_shortest_timeout_ms(void) {
+    uint32_t shortest = UINT32_MAX;
+    uint32_t timeouts[] = {peer_idle_timeout_ms, peer_read_timeout_ms, peer_write_timeout_ms};
+
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+        if (timeouts[i] > 0 && timeouts[i] < shortest) {
+            shortest = timeouts[i];
+        }
+    }
+
+    return shortest;
+}
+
+void
+peer_timer_arm(timer_wheel_t* timers, peer_state_t* peer_state, uintptr_t key) {
+    uint32_t timeout = peer_timeout_ms(peer_state);
+    uint32_t expire = timers->now + timer_wheel_ticks(peer_shortest_timeout_ms());
+    uint32_t deadline = peer_state->last_active + timer_wheel_ticks(timeout);
+
+    if (timeout > 0 && (int32_t) (deadline - expire) < 0) {
+        expire = deadline;
+    }
+
+    peer_state->timer_queued = true;
+
+    timer_wheel_add(timers, key, expire);
+}
+
+// NOTE: a peer taking over the fd of a closed one whose entry is still on the wheel reuses that entry, it fires no
+// later than the shortest timeout and is armed again to the deadline of the new peer. An entry never outlives its fd
+// so it can't be mistaken for the timer of the next peer on it, however often the fd is reused
+void
+peer_timer_start(timer_wheel_t* timers, peer_state_t* peer_state, uintptr_t key, uint32_t now) {
+    peer_state->timer_active = true;
+    peer_state->last_active = now;
 
+    if (!peer_state->timer_queued) {
+        peer_timer_arm(timers, peer_state, key);
+    }
+}
+
+// NOTE: the entry left on the wheel is dropped when it fires
+void
+peer_timer_stop(peer_state_t* peer_state) {
+    peer_state->timer_active = false;
+}
+
+// NOTE: an entry of the peer was popped from the wheel. Returns true when the peer is past its deadline, otherwise the
+// timer is armed again to the deadline moved by the progress made meanwhile, nothing was touched on the way
+bool
+peer_timer_fired(timer_wheel_t* timers, peer_state_t* peer_state, const timer_entry_t* entry) {
+    peer_state->timer_queued = false;
+
+    if (!peer_state->timer_active) {
+        return false;
+    }
+
+    uint32_t timeout = peer_timeout_ms(peer_state);
+
+    if (timeout > 0 && (int32_t) (timers->now - (peer_state->last_active + timer_wheel_ticks(timeout))) >= 0) {
+        return true;
+    }
+
+    peer_timer_arm(timers, peer_state, entry->key);
+
+    return false;
+}
+
+fd_status_t
+on_peer_connected(peer_table_t* peer_table,
+                  int sockfd,
+                  const struct sockaddr_in* peer_addr,
+                  socklen_t peer_addr_len) {
     log_peer_connection(peer_addr, peer_addr_len);
 
     // NOTE: initialize state to send back a '*' to the peer immediately
-    peer_state_t* peer_state = &global_state[sockfd];
+    peer_state_t* peer_state = peer_table_get(peer_table, sockfd);
 
     peer_state->state = INITIAL_ACK;
-    peer_state->send_buf[0] = '*';
-    peer_state->send_ptr = 0;
-    peer_state->send_buf_end = 1;
+    peer_state->read_paused = false;
+    peer_state->read_closed = false;
+    peer_state->zerocopy_draining = false;
+
+    send_queue_clear(&peer_state->send_queue);
+    send_queue_append(&peer_state->send_queue, (const uint8_t*) "*", 1);
+
+    stats_add(&stats_current->accepts, 1);
+    TRACE_PEER(TRACE_ACCEPT, peer_state, sockfd);
+
+    if (peer_table->timers != NULL) {
+        peer_timer_start(peer_table->timers, peer_state, sockfd, peer_table->now);
+    }
 
     return fd_status_mode_t.WRITE;
 }
 
-fd_status_t
-on_peer_ready_recv(int sockfd) {
-    assert(sockfd < MAXFDS);
+// NOTE: drop what's left of a peer, must be called before its fd is closed
+void
+on_peer_closed(peer_table_t* peer_table, int sockfd) {
+    peer_state_t* peer_state = peer_table_get(peer_table, sockfd);
 
-    peer_state_t* peer_state = &global_state[sockfd];
+    send_queue_clear(&peer_state->send_queue);
+    peer_timer_stop(peer_state);
 
-    if (peer_state->state == INITIAL_ACK || peer_state->send_ptr < peer_state->send_buf_end) {
-        return fd_status_mode_t.WRITE;
+    stats_add(&stats_current->closes, 1);
+    TRACE_PEER(TRACE_CLOSE, peer_state, sockfd);
+}
+
+fd_status_t
+on_peer_ready_recv(peer_table_t* peer_table, int sockfd) {
+    peer_state_t* peer_state = peer_table_get(peer_table, sockfd);
+
+    if (!peer_status(peer_state).want_read) {
+        return peer_status(peer_state);
     }
 
-    uint8_t buf[1024];
+    uint8_t buf[RECV_BUF_SIZE];
     int bytes_len = recv(sockfd, buf, sizeof(buf), 0);
 
+    stats_add(&stats_current->syscalls, 1);
+
     if (bytes_len == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return fd_status_mode_t.READ;
+            fd_status_t status = peer_status(peer_state);
+
+            status.would_block = true;
+
+            return status;
         } else {
             errlog("error to receive socket data");
         }
-    } else if (bytes_len == 0) {
-        return fd_status_mode_t.NO_READ_WRITE;
     }
 
-    bool ready_to_send = false;
+    peer_state->last_active = peer_table->now;
 
-    for (int i = 0; i < bytes_len; ++i) {
-        switch (peer_state->state) {
-            case INITIAL_ACK:
-                assert(0 && "can't reach here");
-                break;
-            case WAITTING:
-                if (buf[i] == '^') {
-                    peer_state->state = PROCESSING;
-                }
-                break;
-            case PROCESSING:
-                if (buf[i] == '$') {
-                    peer_state->state = WAITTING;
-                } else {
-                    assert(peer_state->send_buf_end < SEND_BUF_SIZE);
-
-                    peer_state->send_buf[peer_state->send_buf_end++] = buf[i] + 1;
-                    ready_to_send = true;
-                }
-                break;
-        }
+    if (bytes_len == 0) {
+        peer_state->read_closed = true;
+
+        return peer_status(peer_state);
     }
 
-    return (fd_status_t) {.want_read = !ready_to_send, .want_write = ready_to_send};
+    return on_peer_data(peer_state, buf, bytes_len);
 }
 
+// NOTE: runs the state machine over the bytes received from a peer and queue the transformed output. Shared by the
+// readiness (recv on ready) and the completion (data already received) based servers. The buffer is transformed
+// in-place
 fd_status_t
-on_peer_ready_send(int sockfd) {
-    assert(sockfd < MAXFDS);
+on_peer_data(peer_state_t* peer_state, uint8_t* buf, int len) {
+    assert(peer_state->state != INITIAL_ACK && "can't reach here");
 
-    peer_state_t* peer_state = &global_state[sockfd];
+    TRACE_PEER(TRACE_RECV, peer_state, len);
 
-    if (peer_state->send_ptr >= peer_state->send_buf_end) {
-        return fd_status_mode_t.READ_WRITE;
+#ifdef TRACE
+    ProcessingState state = peer_state->state;
+#endif
+
+    int out_len = transform_chunk(&peer_state->state, &peer_state->frame, buf, len, buf);
+
+#ifdef TRACE
+    // NOTE: only the state the chunk left the machine on, a chunk may carry several messages
+    if (peer_state->state != state) {
+        TRACE_PEER(TRACE_STATE, peer_state, peer_state->state);
     }
+#endif
+
+    send_queue_append(&peer_state->send_queue, buf, out_len);
+
+    TRACE_PEER(TRACE_SEND_QUEUED, peer_state, out_len);
 
-    int send_len = peer_state->send_buf_end - peer_state->send_ptr;
-    int sent_len = send(sockfd, &peer_state->send_buf[peer_state->send_ptr], send_len, 0);
+    stats_add(&stats_current->bytes_in, len);
+    stats_hist_add(&stats_current->send_queue_depth, peer_state->send_queue.len);
+
+    if (peer_state->send_queue.len >= send_queue_high_watermark) {
+        peer_state->read_paused = true;
+    }
+
+    // NOTE: the replies before the bad frame are still flushed, like on EOF
+    if (peer_state->state == FRAMING_ERROR && !peer_state->read_closed) {
+        log_warn("peer sent a frame longer than %u bytes, closing", FRAME_MAX_LEN);
+
+        peer_state->read_closed = true;
+    }
+
+    return peer_status(peer_state);
+}
+
+// NOTE: opt-in zerocopy for the sockets of the event loops that watch the error queue, see send_queue_zerocopy_threshold
+void
+enable_peer_zerocopy(peer_table_t* peer_table, int sockfd) {
+    if (send_queue_zerocopy_threshold == 0) {
+        return;
+    }
+
+    int opt = 1;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) == -1) {
+        log_error("%s:%d: error to enable zerocopy on socket %d: %s", __FILE__, __LINE__, sockfd, strerror(errno));
+
+        return;
+    }
+
+    send_queue_enable_zerocopy(&peer_table_get(peer_table, sockfd)->send_queue);
+}
+
+fd_status_t
+on_peer_ready_send(peer_table_t* peer_table, int sockfd) {
+    peer_state_t* peer_state = peer_table_get(peer_table, sockfd);
+
+    if (peer_state->send_queue.len == 0) {
+        return peer_status(peer_state);
+    }
+
+    struct iovec iov[SEND_QUEUE_MAX_IOV];
+    struct msghdr msg = {0};
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = send_queue_iov(&peer_state->send_queue, iov, SEND_QUEUE_MAX_IOV);
+
+    int flags = MSG_NOSIGNAL;
+
+    if (peer_state->send_queue.zerocopy != NULL) {
+        size_t send_len = 0;
+
+        for (size_t i = 0; i < msg.msg_iovlen; i++) {
+            send_len += iov[i].iov_len;
+        }
+
+        if (send_len >= send_queue_zerocopy_threshold) {
+            flags |= MSG_ZEROCOPY;
+        }
+    }
+
+    int sent_len = sendmsg(sockfd, &msg, flags);
+
+    stats_add(&stats_current->syscalls, 1);
+
+    // NOTE: the socket ran out of optmem to pin more pages, copy until some notifications are read
+    if (sent_len == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        flags &= ~MSG_ZEROCOPY;
+        sent_len = sendmsg(sockfd, &msg, flags);
+
+        stats_add(&stats_current->syscalls, 1);
+    }
 
     if (sent_len == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return fd_status_mode_t.WRITE;
+            fd_status_t status = peer_status(peer_state);
+
+            status.would_block = true;
+
+            return status;
         } else {
             errlog("error to send data on socket");
         }
     }
 
-    if (sent_len < send_len) {
-        peer_state->send_ptr += sent_len;
+    if (flags & MSG_ZEROCOPY) {
+        send_queue_zerocopy_sent(&peer_state->send_queue, msg.msg_iovlen);
+    }
 
-        return fd_status_mode_t.WRITE;
-    } else {
-        // NOTE: everything was sent successfully, reset the send queue
-        peer_state->send_ptr = 0;
-        peer_state->send_buf_end = 0;
+    peer_state->last_active = peer_table->now;
+
+    return on_peer_data_sent(peer_state, sent_len);
+}
+
+// NOTE: the socket reported an error (EPOLLERR), read the MSG_ZEROCOPY notifications from its error queue. Returns
+// false when it's a real socket error and the peer must be closed
+bool
+on_peer_ready_error(peer_table_t* peer_table, int sockfd) {
+    peer_state_t* peer_state = peer_table_get(peer_table, sockfd);
+
+    while (1) {
+        uint8_t control[128];
+        struct msghdr msg = {0};
+
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        stats_add(&stats_current->syscalls, 1);
+
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
 
-        // NOTE: special-case state transition in if we were in INITIAL_ACK until now
+            return false;
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                  || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            struct sock_extended_err* err = (struct sock_extended_err*) CMSG_DATA(cmsg);
+
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                return false;
+            }
+
+            if (peer_state->send_queue.zerocopy != NULL) {
+                send_queue_zerocopy_completed(&peer_state->send_queue, err->ee_info, err->ee_data);
+            }
+
+            // NOTE: the peer acknowledged the data, it's progress for a closed peer waiting on its notifications
+            peer_state->last_active = peer_table->now;
+        }
+    }
+
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+
+    return getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0;
+}
+
+fd_status_t
+on_peer_data_sent(peer_state_t* peer_state, int sent_len) {
+    send_queue_consume(&peer_state->send_queue, sent_len);
+
+    stats_add(&stats_current->bytes_out, sent_len);
+    TRACE_PEER(TRACE_SEND_DONE, peer_state, sent_len);
+
+    if (peer_state->send_queue.len == 0) {
+        // NOTE: special-case state transition in if we were in INITIAL_ACK until now, the peer picks its protocol next
         if (peer_state->state == INITIAL_ACK) {
-            peer_state->state = WAITTING;
+            peer_state->state = HANDSHAKE;
         }
+    }
 
-        return fd_status_mode_t.READ;
+    if (peer_state->read_paused && peer_state->send_queue.len <= send_queue_low_watermark) {
+        peer_state->read_paused = false;
     }
+
+    return peer_status(peer_state);
+}
+
+// NOTE: per-loop allocation pools of the libuv server
+typedef struct {
+    pool_t read_bufs;
+    pool_t write_reqs;
+    pool_t clients;
+    pool_t peers;
+} uv_loop_pools_t;
+
+uv_loop_pools_t*
+uv_loop_pools_create(void) {
+    uv_loop_pools_t* pools = (uv_loop_pools_t*) malloc(sizeof(*pools));
+
+    if (pools == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    // NOTE: the loop reads one handle at a time and the buffer is released right after, so a few buffers are enough
+    pool_init(&pools->read_bufs, "read_buf", RECV_BUF_SIZE, UV_READ_BUF_POOL_MAX_FREE);
+    pool_init(&pools->write_reqs, "write_req", sizeof(uv_write_t), UV_POOL_MAX_FREE);
+    pool_init(&pools->clients, "client", sizeof(uv_tcp_t), UV_POOL_MAX_FREE);
+    pool_init(&pools->peers, "peer", sizeof(peer_state_t), UV_POOL_MAX_FREE);
+
+    return pools;
+}
+
+void
+uv_loop_pools_print_stats(const uv_loop_pools_t* pools, FILE* out) {
+    pool_print_stats(&pools->read_bufs, out);
+    pool_print_stats(&pools->write_reqs, out);
+    pool_print_stats(&pools->clients, out);
+    pool_print_stats(&pools->peers, out);
+}
+
+void
+uv_loop_pools_destroy(uv_loop_pools_t* pools) {
+    pool_destroy(&pools->read_bufs);
+    pool_destroy(&pools->write_reqs);
+    pool_destroy(&pools->clients);
+    pool_destroy(&pools->peers);
+
+    free(pools);
+}
+
+// NOTE: per-loop state of the libuv server, reachable from any handle through loop->data. The stop handles are shared
+// by every loop of the server, one async handle per loop
+typedef struct {
+    uv_loop_pools_t* pools;
+    uv_async_t** stop_handles;
+    int nloops;
+    // NOTE: the peers are keyed by their state address on the wheel, a single libuv timer wakes the loop when it's due
+    timer_wheel_t* timers;
+    uv_timer_t* timer_handle;
+} uv_loop_ctx_t;
+
+uv_loop_pools_t*
+uv_pools(const uv_handle_t* handle) {
+    return ((uv_loop_ctx_t*) handle->loop->data)->pools;
+}
+
+// NOTE: uv_stop only works from the loop thread, the other loops are woken up to stop themselves
+void
+uv_stop_server(uv_loop_t* loop) {
+    uv_loop_ctx_t* ctx = (uv_loop_ctx_t*) loop->data;
+
+    for (int i = 0; i < ctx->nloops; i++) {
+        uv_async_send(ctx->stop_handles[i]);
+    }
+}
+
+// NOTE: the loop time is cached by libuv on every iteration, it's the clock of the loop timer wheel
+uint32_t
+uv_loop_tick(uv_loop_t* loop) {
+    return (uint32_t) (uv_now(loop) / TIMER_WHEEL_TICK_MS);
 }
 
 void
 uv_on_client_closed(uv_handle_t* handle) {
     uv_tcp_t* client = (uv_tcp_t*) handle;
+    uv_loop_pools_t* pools = uv_pools(handle);
 
     if (client->data) {
-        free(client->data);
+        peer_state_t* peerstate = (peer_state_t*) client->data;
+
+        send_queue_clear(&peerstate->send_queue);
+        peer_timer_stop(peerstate);
+
+        stats_add(&stats_current->closes, 1);
+        TRACE_PEER(TRACE_CLOSE, peerstate, 0);
+
+        // NOTE: the wheel still points to the peer state, it's released once its stale entry is popped
+        if (peerstate->timer_queued) {
+            peerstate->client = NULL;
+        } else {
+            pool_release(&pools->peers, peerstate);
+        }
     }
 
-    free(client);
+    pool_release(&pools->clients, client);
 }
 
 void
-uv_on_wrote_buffer(uv_write_t* req, int status) {
-    if (status) {
-        errlog("libuv error to write on connection: %s", uv_strerror(status));
+uv_close_peer(peer_state_t* peerstate) {
+    if (!uv_is_closing((uv_handle_t*) peerstate->client)) {
+        uv_close((uv_handle_t*) peerstate->client, uv_on_client_closed);
     }
+}
 
-    peer_state_t* peerstate = (peer_state_t*) req->data;
+void
+uv_on_peer_timer(timer_entry_t* entry, void* arg) {
+    uv_loop_t* loop = (uv_loop_t*) arg;
+    uv_loop_ctx_t* ctx = (uv_loop_ctx_t*) loop->data;
+    peer_state_t* peerstate = (peer_state_t*) entry->key;
 
-    // NOTE: if the message ends with 'WXY' finish the connection and close the main event loop
-    if (peerstate->send_buf_end >= 3 && peerstate->send_buf[peerstate->send_buf_end - 3] == 'X'
-        && peerstate->send_buf[peerstate->send_buf_end - 2] == 'Y'
-        && peerstate->send_buf[peerstate->send_buf_end - 1] == 'Z') {
-        free(peerstate);
-        free(req);
+    if (peerstate->client == NULL) {
+        pool_release(&ctx->pools->peers, peerstate);
 
-        uv_stop(uv_default_loop());
+        return;
+    }
+
+    if (peer_timer_fired(ctx->timers, peerstate, entry)) {
+        log_info("peer timed out");
+
+        uv_close_peer(peerstate);
+    }
+}
 
+void uv_arm_timers(uv_loop_t* loop);
+
+void
+uv_on_timers_due(uv_timer_t* handle) {
+    uv_loop_ctx_t* ctx = (uv_loop_ctx_t*) handle->loop->data;
+
+    timer_wheel_advance(ctx->timers, uv_loop_tick(handle->loop), uv_on_peer_timer, handle->loop);
+
+    uv_arm_timers(handle->loop);
+}
+
+// NOTE: the libuv timer is only moved when the wheel needs the loop awake earlier than it's already set to
+void
+uv_arm_timers(uv_loop_t* loop) {
+    uv_loop_ctx_t* ctx = (uv_loop_ctx_t*) loop->data;
+
+    if (ctx->timers == NULL) {
         return;
     }
 
-    peerstate->send_buf_end = 0;
+    int timeout = timer_wheel_timeout_ms(ctx->timers, uv_loop_tick(loop));
 
-    free(req);
+    if (timeout < 0) {
+        uv_timer_stop(ctx->timer_handle);
+    } else if (!uv_is_active((uv_handle_t*) ctx->timer_handle)
+               || uv_timer_get_due_in(ctx->timer_handle) > (uint64_t) timeout) {
+        uv_timer_start(ctx->timer_handle, uv_on_timers_due, timeout, 0);
+    }
 }
 
+void uv_on_wrote_buffer(uv_write_t* req, int status);
+
+// NOTE: only one write is in flight per peer, it takes everything queued so far (up to SEND_QUEUE_MAX_IOV chunks)
 void
-uv_on_alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-    UNUSED(handle);
+uv_flush_send_queue(peer_state_t* peerstate) {
+    if (peerstate->write_inflight > 0 || peerstate->send_queue.len == 0) {
+        return;
+    }
 
-    buf->base = (char*) malloc(suggested_size);
+    struct iovec iov[SEND_QUEUE_MAX_IOV];
+    uv_buf_t write_bufs[SEND_QUEUE_MAX_IOV];
 
-    if (buf->base == NULL) {
-        errlog("error to allocate memory");
+    int iov_len = send_queue_iov(&peerstate->send_queue, iov, SEND_QUEUE_MAX_IOV);
+
+    for (int i = 0; i < iov_len; i++) {
+        write_bufs[i] = uv_buf_init((char*) iov[i].iov_base, iov[i].iov_len);
+        peerstate->write_inflight += iov[i].iov_len;
+    }
+
+    uv_write_t* write_req = (uv_write_t*) pool_alloc(&uv_pools((uv_handle_t*) peerstate->client)->write_reqs);
+
+    write_req->data = peerstate;
+
+    int rc;
+
+    if ((rc = uv_write(write_req, (uv_stream_t*) peerstate->client, write_bufs, iov_len, uv_on_wrote_buffer)) < 0) {
+        errlog("libuv error to write: %s", uv_strerror(rc));
     }
+}
 
-    buf->len = suggested_size;
+// NOTE: libuv suggests 64 KB per read, the pooled buffers have the same size of the recv buffer on the readiness
+// servers and a read that doesn't fit is just split on the next one
+void
+uv_on_alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    UNUSED(suggested_size);
+
+    buf->base = (char*) pool_alloc(&uv_pools(handle)->read_bufs);
+    buf->len = RECV_BUF_SIZE;
 }
 
 void
 uv_on_peer_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf) {
+    peer_state_t* peerstate = (peer_state_t*) client->data;
+    pool_t* read_bufs = &uv_pools((uv_handle_t*) client)->read_bufs;
+
+    peerstate->last_active = uv_loop_tick(client->loop);
+
     if (nread < 0) {
         if (nread != UV_EOF) {
-            fprintf(stderr, "libuv error reading connection: %s\n", uv_strerror(nread));
+            log_error("libuv error reading connection: %s", uv_strerror(nread));
         }
 
-        uv_close((uv_handle_t*) client, uv_on_client_closed);
+        // NOTE: on a clean EOF the pending output is still flushed before closing
+        if (nread == UV_EOF && peerstate->write_inflight > 0) {
+            peerstate->read_closed = true;
+
+            uv_read_stop(client);
+        } else {
+            uv_close_peer(peerstate);
+        }
     } else if (nread == 0) {
         // NOTE: don't do nothing is not an error
     } else {
         assert((ssize_t) buf->len >= nread);
 
-        peer_state_t* peerstate = (peer_state_t*) client->data;
-
         if (peerstate->state == INITIAL_ACK) {
-            free(buf->base);
+            pool_release(read_bufs, buf->base);
 
             return;
         }
 
-        for (int i = 0; i < nread; i++) {
-            switch (peerstate->state) {
-                case INITIAL_ACK:
-                    assert(0 && "can't reach here");
-                    break;
-                case WAITTING:
-                    if (buf->base[i] == '^') {
-                        peerstate->state = PROCESSING;
-                    }
-
-                    break;
-                case PROCESSING:
-                    if (buf->base[i] == '$') {
-                        peerstate->state = WAITTING;
-                    } else {
-                        assert(peerstate->send_buf_end < SEND_BUF_SIZE);
-
-                        peerstate->send_buf[peerstate->send_buf_end++] = buf->base[i] + 1;
-                    }
-
-                    break;
-            }
-        }
+        // NOTE: the read buffer is released right after, so it's transformed in-place
+        on_peer_data(peerstate, (uint8_t*) buf->base, nread);
 
-        if (peerstate->send_buf_end > 0) {
-            uv_buf_t write_buf = uv_buf_init((char*) peerstate->send_buf, peerstate->send_buf_end);
-            uv_write_t* write_req = (uv_write_t*) malloc(sizeof(*write_req));
+        send_chunk_t* tail = peerstate->send_queue.tail;
 
-            if (write_req == NULL) {
-                errlog("error to allocate memory");
-            }
+        // NOTE: if the message ends with 'WXY' finish the connection and close the main event loop
+        if (tail != NULL && tail->end - tail->start >= 3 && memcmp(&tail->data[tail->end - 3], "XYZ", 3) == 0) {
+            peerstate->stop_loop = true;
+        }
 
-            write_req->data = peerstate;
+        if (peerstate->read_paused || peerstate->read_closed) {
+            uv_read_stop(client);
+        }
 
-            int rc;
+        uv_flush_send_queue(peerstate);
 
-            if ((rc = uv_write(write_req, (uv_stream_t*) client, &write_buf, 1, uv_on_wrote_buffer)) < 0) {
-                errlog("libuv error to write: %s", uv_strerror(rc));
-            }
+        // NOTE: a broken frame with no reply left to write, otherwise it closes once the write is done
+        if (peerstate->read_closed && peerstate->write_inflight == 0) {
+            uv_close_peer(peerstate);
         }
     }
 
-    free(buf->base);
+    pool_release(read_bufs, buf->base);
 }
 
 void
-uv_on_wrote_init_ack(uv_write_t* req, int status) {
+uv_on_wrote_buffer(uv_write_t* req, int status) {
+    peer_state_t* peerstate = (peer_state_t*) req->data;
+
+    pool_release(&uv_pools((uv_handle_t*) req->handle)->write_reqs, req);
+
     if (status) {
-        errlog("libuv write error: %s", uv_strerror(status));
+        // NOTE: pending writes are canceled when the handle closes
+        if (status != UV_ECANCELED) {
+            log_error("%s:%d: libuv error to write on connection: %s", __FILE__, __LINE__, uv_strerror(status));
+
+            uv_close_peer(peerstate);
+        }
+
+        return;
     }
 
-    peer_state_t* peerstate = (peer_state_t*) req->data;
+    bool was_reading = peer_status(peerstate).want_read;
 
-    peerstate->state = WAITTING;
-    peerstate->send_buf_end = 0;
+    peerstate->last_active = uv_loop_tick(peerstate->client->loop);
 
-    int rc;
+    // NOTE: leaves INITIAL_ACK once the '*' is sent and resumes a paused peer below the low watermark
+    on_peer_data_sent(peerstate, peerstate->write_inflight);
+
+    peerstate->write_inflight = 0;
 
-    if ((rc = uv_read_start((uv_stream_t*) peerstate->client, uv_on_alloc_buffer, uv_on_peer_read)) < 0) {
-        errlog("libuv error to read connection: %s", uv_strerror(rc));
+    if (peerstate->send_queue.len == 0) {
+        if (peerstate->stop_loop) {
+            uv_stop_server(peerstate->client->loop);
+
+            return;
+        }
+
+        if (peerstate->read_closed) {
+            uv_close_peer(peerstate);
+
+            return;
+        }
+    }
+
+    if (!was_reading && peer_status(peerstate).want_read) {
+        int rc;
+
+        if ((rc = uv_read_start((uv_stream_t*) peerstate->client, uv_on_alloc_buffer, uv_on_peer_read)) < 0) {
+            errlog("libuv error to read connection: %s", uv_strerror(rc));
+        }
     }
 
-    free(req);
+    uv_flush_send_queue(peerstate);
 }
 
 void
 uv_on_peer_connected(uv_stream_t* server_stream, int status) {
     if (status < 0) {
-        fprintf(stderr, "%s:%d: peer connection error: %s\n", __FILE__, __LINE__, uv_strerror(status));
+        log_error("%s:%d: peer connection error: %s", __FILE__, __LINE__, uv_strerror(status));
 
         return;
     }
 
-    uv_tcp_t* client = (uv_tcp_t*) malloc(sizeof(*client));
-
-    if (client == NULL) {
-        errlog("error to allocate memory");
-    }
+    uv_loop_pools_t* pools = uv_pools((uv_handle_t*) server_stream);
+    uv_tcp_t* client = (uv_tcp_t*) pool_alloc(&pools->clients);
 
     int rc;
 
-    if ((rc = uv_tcp_init(uv_default_loop(), client)) == -1) {
+    if ((rc = uv_tcp_init(server_stream->loop, client)) == -1) {
         errlog("libuv client connection failed: %s", uv_strerror(rc));
     }
 
@@ -420,31 +1198,32 @@ uv_on_peer_connected(uv_stream_t* server_stream, int status) {
 
         // uv_report_peer_connected((const struct sockaddr_in*) &peername, namelen);
 
-        peer_state_t* peerstate = (peer_state_t*) malloc(sizeof(*peerstate));
-
-        if (peerstate == NULL) {
-            errlog("error to allocate memory");
-        }
+        peer_state_t* peerstate = (peer_state_t*) pool_alloc(&pools->peers);
 
         peerstate->state = INITIAL_ACK;
-        peerstate->send_buf[0] = '*';
-        peerstate->send_buf_end = 1;
+        peerstate->read_paused = false;
+        peerstate->read_closed = false;
         peerstate->client = client;
+        peerstate->write_inflight = 0;
+        peerstate->stop_loop = false;
+        peerstate->timer_queued = false;
 
-        client->data = peerstate;
+        send_queue_init(&peerstate->send_queue);
+        send_queue_append(&peerstate->send_queue, (const uint8_t*) "*", 1);
 
-        uv_buf_t write_buf = uv_buf_init((char*) peerstate->send_buf, peerstate->send_buf_end);
-        uv_write_t* req = (uv_write_t*) malloc(sizeof(*req));
+        stats_add(&stats_current->accepts, 1);
 
-        if (req == NULL) {
-            errlog("error to allocate memory");
-        }
+        client->data = peerstate;
 
-        req->data = peerstate;
+        uv_loop_ctx_t* ctx = (uv_loop_ctx_t*) server_stream->loop->data;
 
-        if ((rc = uv_write(req, (uv_stream_t*) client, &write_buf, 1, uv_on_wrote_init_ack)) < 0) {
-            errlog("libuv write on connection error: %s", uv_strerror(rc));
+        if (ctx->timers != NULL) {
+            peer_timer_start(ctx->timers, peerstate, (uintptr_t) peerstate, uv_loop_tick(server_stream->loop));
+            uv_arm_timers(server_stream->loop);
         }
+
+        // NOTE: the peer is only read after the '*' is written
+        uv_flush_send_queue(peerstate);
     } else {
         uv_close((uv_handle_t*) client, uv_on_client_closed);
     }
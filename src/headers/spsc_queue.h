@@ -0,0 +1,83 @@
+#ifndef HEADERS_SPSC_QUEUE_H
+#define HEADERS_SPSC_QUEUE_H
+
+// NOTE: bounded lock-free ring of fixed size items with a single producer thread and a single consumer thread. Each
+// side only writes its own index, kept on a cache line of its own, and the items are copied in and out of the slots.
+//
+// push reports when it found the ring empty, the only case the consumer may be asleep on it: the producer publishes
+// the item and then loads the consumer index while the consumer publishes its index and then loads the producer one,
+// with sequential consistency at least one of both sees the other, so a consumer that found the ring empty always gets
+// woken up
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+
+typedef struct {
+    uint8_t* slots;
+    size_t item_size;
+    uint64_t cap;
+    // NOTE: next slot to pop, written by the consumer only
+    uint64_t head __attribute__((aligned(64)));
+    // NOTE: next slot to push, written by the producer only
+    uint64_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64))) spsc_queue_t;
+
+// NOTE: cap is rounded up to a power of two
+void
+spsc_queue_init(spsc_queue_t* queue, size_t item_size, uint64_t cap) {
+    uint64_t slots = 1;
+
+    while (slots < cap) {
+        slots <<= 1;
+    }
+
+    queue->slots = (uint8_t*) malloc(slots * item_size);
+    queue->item_size = item_size;
+    queue->cap = slots;
+    queue->head = 0;
+    queue->tail = 0;
+
+    if (queue->slots == NULL) {
+        errlog("error to allocate memory");
+    }
+}
+
+// NOTE: producer only, returns false when the ring is full. was_empty tells if the consumer must be woken up
+bool
+spsc_queue_push(spsc_queue_t* queue, const void* item, bool* was_empty) {
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->cap) {
+        return false;
+    }
+
+    memcpy(&queue->slots[(tail & (queue->cap - 1)) * queue->item_size], item, queue->item_size);
+
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    *was_empty = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) == tail;
+
+    return true;
+}
+
+// NOTE: consumer only, returns false when the ring is empty
+bool
+spsc_queue_pop(spsc_queue_t* queue, void* item) {
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == head) {
+        return false;
+    }
+
+    memcpy(item, &queue->slots[(head & (queue->cap - 1)) * queue->item_size], queue->item_size);
+
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+
+    return true;
+}
+
+#endif
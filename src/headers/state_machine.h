@@ -31,67 +31,471 @@
  *       +----------------+               +----------------+
  *                          IN: RECEIVED $
  *
+ * the first byte the peer sends after the '*' picks the wire mode (HANDSHAKE):
+ * FRAME_HANDSHAKE switches the peer to the framed protocol (FRAMING), anything
+ * else starts the '^...$' protocol above, that byte included (a byte before
+ * '^' is ignored anyway). See FRAMED PROTOCOL below.
  */
 
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRANSFORM_X86
+#endif
+
+#include "coro.h"
 #include "error.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+
+typedef enum { INITIAL_ACK, HANDSHAKE, WAITTING, PROCESSING, FRAMING, FRAMING_ERROR } ProcessingState;
+
+#define FRAME_HANDSHAKE '#'
+// NOTE: the buffer lives on the stack of the serving thread or coroutine (CORO_STACK_SIZE is 32 KB), a request of a
+// few KB is read, transformed and sent back in one go instead of several small sends
+#define STATE_MACHINE_RECV_BUF_SIZE (8 * 1024)
+#define FRAME_HEADER_SIZE 4
+// NOTE: the biggest body the remaining bitfield of frame_state_t holds
+#define FRAME_MAX_LEN ((1u << 29) - 1)
+
+// NOTE: header_len bytes of the current header were read, the length so far is on remaining. Once the header is whole
+// (header_len == FRAME_HEADER_SIZE) remaining counts the body bytes still to come, a peer between frames has both zero
+typedef struct {
+    unsigned remaining : 29;
+    unsigned header_len : 3;
+} frame_state_t;
+
+/*
+ * ----------------
+ * TRANSFORM KERNEL
+ * ----------------
+ *
+ * every server family runs the '^...$' protocol through transform_span()
+ * (via transform_chunk()): it consumes the whole input, writes (X + 1) for every byte X between '^' and
+ * '$' to out and returns how many bytes were written. Instead of branching on
+ * every byte, the delimiters are searched on whole vectors and the span in
+ * between is transformed at once.
+ *
+ * out needs room for len bytes and may be the input itself (in-place), the
+ * output never gets ahead of the input.
+ */
+
+typedef size_t (*transform_fn_t)(ProcessingState* state, const uint8_t* in, size_t len, uint8_t* out);
+// NOTE: (X + 1) for every byte, the body of a frame has no delimiters to look for
+typedef void (*transform_body_fn_t)(const uint8_t* in, size_t len, uint8_t* out);
+
+void
+transform_body_scalar(const uint8_t* in, size_t len, uint8_t* out) {
+    for (size_t i = 0; i < len; i++) {
+        out[i] = in[i] + 1;
+    }
+}
+
+size_t
+transform_span_scalar(ProcessingState* state, const uint8_t* in, size_t len, uint8_t* out) {
+    assert(*state != INITIAL_ACK);
+
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < len) {
+        if (*state == WAITTING) {
+            const uint8_t* caret = memchr(&in[i], '^', len - i);
+
+            if (caret == NULL) {
+                break;
+            }
+
+            i = caret - in + 1;
+            *state = PROCESSING;
+        } else {
+            const uint8_t* dollar = memchr(&in[i], '$', len - i);
+            size_t span = (dollar == NULL ? len : (size_t) (dollar - in)) - i;
+
+            for (size_t k = 0; k < span; k++) {
+                out[o + k] = in[i + k] + 1;
+            }
+
+            i += span;
+            o += span;
+
+            if (dollar != NULL) {
+                i++;
+                *state = WAITTING;
+            }
+        }
+    }
+
+    return o;
+}
+
+#ifdef TRANSFORM_X86
+size_t
+transform_span_sse2(ProcessingState* state, const uint8_t* in, size_t len, uint8_t* out) {
+    assert(*state != INITIAL_ACK);
+
+    const __m128i caret = _mm_set1_epi8('^');
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i one = _mm_set1_epi8(1);
+
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i + 16 <= len) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) &in[i]);
+
+        if (*state == WAITTING) {
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, caret));
+
+            if (mask == 0) {
+                i += 16;
+            } else {
+                i += __builtin_ctz(mask) + 1;
+                *state = PROCESSING;
+            }
+        } else {
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dollar));
+
+            if (mask == 0) {
+                _mm_storeu_si128((__m128i*) &out[o], _mm_add_epi8(chunk, one));
+
+                i += 16;
+                o += 16;
+            } else {
+                // NOTE: a partial span is copied byte by byte, a full store could clobber input not read yet when
+                // transforming in-place
+                unsigned span = __builtin_ctz(mask);
+
+                for (unsigned k = 0; k < span; k++) {
+                    out[o + k] = in[i + k] + 1;
+                }
+
+                i += span + 1;
+                o += span;
+                *state = WAITTING;
+            }
+        }
+    }
+
+    return o + transform_span_scalar(state, &in[i], len - i, &out[o]);
+}
+
+void
+transform_body_sse2(const uint8_t* in, size_t len, uint8_t* out) {
+    const __m128i one = _mm_set1_epi8(1);
+
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i*) &out[i], _mm_add_epi8(_mm_loadu_si128((const __m128i*) &in[i]), one));
+    }
+
+    transform_body_scalar(&in[i], len - i, &out[i]);
+}
+
+__attribute__((target("avx2"))) size_t
+transform_span_avx2(ProcessingState* state, const uint8_t* in, size_t len, uint8_t* out) {
+    assert(*state != INITIAL_ACK);
+
+    const __m256i caret = _mm256_set1_epi8('^');
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i one = _mm256_set1_epi8(1);
+
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i + 32 <= len) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) &in[i]);
+
+        if (*state == WAITTING) {
+            unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, caret));
+
+            if (mask == 0) {
+                i += 32;
+            } else {
+                i += __builtin_ctz(mask) + 1;
+                *state = PROCESSING;
+            }
+        } else {
+            unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, dollar));
+
+            if (mask == 0) {
+                _mm256_storeu_si256((__m256i*) &out[o], _mm256_add_epi8(chunk, one));
+
+                i += 32;
+                o += 32;
+            } else {
+                unsigned span = __builtin_ctz(mask);
+
+                for (unsigned k = 0; k < span; k++) {
+                    out[o + k] = in[i + k] + 1;
+                }
+
+                i += span + 1;
+                o += span;
+                *state = WAITTING;
+            }
+        }
+    }
+
+    return o + transform_span_sse2(state, &in[i], len - i, &out[o]);
+}
+
+__attribute__((target("avx2"))) void
+transform_body_avx2(const uint8_t* in, size_t len, uint8_t* out) {
+    const __m256i one = _mm256_set1_epi8(1);
+
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        _mm256_storeu_si256((__m256i*) &out[i], _mm256_add_epi8(_mm256_loadu_si256((const __m256i*) &in[i]), one));
+    }
+
+    transform_body_sse2(&in[i], len - i, &out[i]);
+}
+#endif
+
+static transform_fn_t transform_span_impl = transform_span_scalar;
+static transform_body_fn_t transform_body_impl = transform_body_scalar;
+
+// NOTE: runtime CPU dispatch, resolved once before main()
+__attribute__((constructor)) void
+transform_span_select(void) {
+#ifdef TRANSFORM_X86
+    __builtin_cpu_init();
 
-typedef enum { INITIAL_ACK, WAITTING, PROCESSING } ProcessingState;
+    if (__builtin_cpu_supports("avx2")) {
+        transform_span_impl = transform_span_avx2;
+        transform_body_impl = transform_body_avx2;
+    } else {
+        transform_span_impl = transform_span_sse2;
+        transform_body_impl = transform_body_sse2;
+    }
+#endif
+}
+
+size_t
+transform_span(ProcessingState* state, const uint8_t* in, size_t len, uint8_t* out) {
+    return transform_span_impl(state, in, len, out);
+}
+
+/*
+ * ---------------
+ * FRAMED PROTOCOL
+ * ---------------
+ *
+ * a frame is a FRAME_HEADER_SIZE bytes big-endian body length and the body.
+ * The reply to a frame is a frame of the same length with (X + 1) for every
+ * byte X of the body, so the header is echoed as it is read and the body is
+ * transformed whole, without looking for delimiters. A body may span several
+ * reads and a read may carry several frames, every reply of a read goes out
+ * on the same write.
+ *
+ * transform_frames consumes the whole input and writes exactly as many bytes
+ * to out, which may be the input itself. A header above FRAME_MAX_LEN leaves
+ * the peer on FRAMING_ERROR, the input after it is dropped and only the
+ * output before it is returned.
+ */
+
+size_t
+transform_frames(ProcessingState* state, frame_state_t* frame, const uint8_t* in, size_t len, uint8_t* out) {
+    assert(*state == FRAMING);
+
+    size_t i = 0;
+
+    while (i < len) {
+        if (frame->header_len < FRAME_HEADER_SIZE) {
+            uint64_t length = (uint64_t) frame->remaining << 8 | in[i];
+
+            // NOTE: the prefix read so far is checked on every byte, no byte of a bad header is echoed
+            if (length > FRAME_MAX_LEN >> 8 * (FRAME_HEADER_SIZE - 1 - frame->header_len)) {
+                *state = FRAMING_ERROR;
+
+                break;
+            }
+
+            out[i] = in[i];
+            i++;
+
+            frame->remaining = length;
+            frame->header_len++;
+
+            // NOTE: an empty body, the reply is the header alone
+            if (frame->header_len == FRAME_HEADER_SIZE && frame->remaining == 0) {
+                frame->header_len = 0;
+            }
+        } else {
+            size_t span = len - i < frame->remaining ? len - i : frame->remaining;
+
+            transform_body_impl(&in[i], span, &out[i]);
+
+            i += span;
+            frame->remaining -= span;
+
+            if (frame->remaining == 0) {
+                frame->header_len = 0;
+            }
+        }
+    }
+
+    return i;
+}
+
+// NOTE: runs a received chunk through the protocol the peer picked on its first byte, out as on transform_span
+size_t
+transform_chunk(ProcessingState* state, frame_state_t* frame, const uint8_t* in, size_t len, uint8_t* out) {
+    if (*state == HANDSHAKE && len > 0) {
+        if (in[0] == FRAME_HANDSHAKE) {
+            frame->remaining = 0;
+            frame->header_len = 0;
+
+            *state = FRAMING;
+            in++;
+            len--;
+        } else {
+            *state = WAITTING;
+        }
+    }
+
+    switch (*state) {
+        case WAITTING:
+        case PROCESSING:
+            return transform_span(state, in, len, out);
+        case FRAMING:
+            return transform_frames(state, frame, in, len, out);
+        default:
+            return 0;
+    }
+}
+
+// NOTE: the peer is in the middle of a message, it's held to the read timeout until the message ends
+bool
+in_message(ProcessingState state, frame_state_t frame) {
+    return state == PROCESSING || (state == FRAMING && frame.header_len > 0);
+}
+
+// NOTE: a blocking send may still write only part of the buffer (e.g. interrupted by a signal), keep sending the rest
+bool
+send_all(int sockfd, const uint8_t* buf, size_t len) {
+    size_t sent = 0;
+
+    while (sent < len) {
+        ssize_t sent_len = coro_send(sockfd, &buf[sent], len - sent, 0);
+
+        stats_add(&stats_current->syscalls, 1);
+
+        if (sent_len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        sent += sent_len;
+    }
+
+    stats_add(&stats_current->bytes_out, len);
+
+    return true;
+}
 
 void
 start_state_machine(int sockfd) {
-    if (send(sockfd, "*", 1, 0) != 1) {
-        errlog("error to send '*' message on socket");
+    stats_add(&stats_current->accepts, 1);
+
+    // NOTE: the answer of a request split over several reads goes out as several small sends, Nagle would hold each
+    // one back until the delayed ACK of the previous one (~40 ms)
+    int opt = 1;
+
+    stats_add(&stats_current->syscalls, 1);
+
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1) {
+        log_warn("%s:%d: error to set TCP_NODELAY on socket: %s", __FILE__, __LINE__, strerror(errno));
+    }
+
+    // NOTE: a peer gone before the '*' only closes its own connection, errlog() would take every peer down with it
+    if (coro_send(sockfd, "*", 1, 0) != 1) {
+        log_error("%s:%d: error to send '*' message on socket: %s", __FILE__, __LINE__, strerror(errno));
+
+        stats_add(&stats_current->closes, 1);
+        close(sockfd);
+
+        return;
     }
 
-    ProcessingState state = WAITTING;
+    stats_add(&stats_current->syscalls, 1);
+    stats_add(&stats_current->bytes_out, 1);
+
+    // NOTE: the state lives on the stack of the thread serving the peer, its address identifies the peer on the trace
+    ProcessingState state = HANDSHAKE;
+    frame_state_t frame = {0};
+
+    TRACE_PEER(TRACE_ACCEPT, &state, sockfd);
 
     while (1) {
-        uint8_t buf[1024];
-        int len = recv(sockfd, buf, sizeof(buf), 0);
+        uint8_t buf[STATE_MACHINE_RECV_BUF_SIZE];
+        int len = coro_recv(sockfd, buf, sizeof(buf), 0);
+
+        stats_add(&stats_current->syscalls, 1);
 
         if (len < 0) {
-            errlog("error to receive message on socket");
+            log_error("%s:%d: error to receive message on socket: %s", __FILE__, __LINE__, strerror(errno));
+
+            break;
         } else if (len == 0) {
             break;
         }
 
-        for (int i = 0; i < len; i++) {
-            switch (state) {
-                case INITIAL_ACK:
-                    printf("test");
-                    continue;
-                case WAITTING:
-                    if (buf[i] == '^') {
-                        state = PROCESSING;
-                    }
-
-                    break;
-                case PROCESSING:
-                    if (buf[i] == '$') {
-                        state = WAITTING;
-                    } else {
-                        buf[i] += 1;
-
-                        if (send(sockfd, &buf[i], 1, 0) != 1) {
-                            errlog("error to send message (processing) on socket");
-                            close(sockfd);
-
-                            return;
-                        }
-                    }
-
-                    break;
-            }
+        stats_add(&stats_current->bytes_in, len);
+        TRACE_PEER(TRACE_RECV, &state, len);
+
+#ifdef TRACE
+        ProcessingState previous_state = state;
+#endif
+
+        // NOTE: the whole transformed chunk goes out on a single send instead of one syscall (and segment) per byte
+        int out_len = transform_chunk(&state, &frame, buf, len, buf);
+
+#ifdef TRACE
+        if (state != previous_state) {
+            TRACE_PEER(TRACE_STATE, &state, state);
+        }
+#endif
+
+        TRACE_PEER(TRACE_SEND_QUEUED, &state, out_len);
+
+        if (out_len > 0 && !send_all(sockfd, buf, out_len)) {
+            log_error("%s:%d: error to send message (processing) on socket: %s", __FILE__, __LINE__, strerror(errno));
+
+            break;
+        }
+
+        TRACE_PEER(TRACE_SEND_DONE, &state, out_len);
+
+        if (state == FRAMING_ERROR) {
+            log_warn("socket %d sent a frame longer than %u bytes, closing", sockfd, FRAME_MAX_LEN);
+
+            break;
         }
     }
 
+    stats_add(&stats_current->closes, 1);
+    TRACE_PEER(TRACE_CLOSE, &state, sockfd);
+
     close(sockfd);
 }
 
@@ -0,0 +1,318 @@
+#ifndef HEADERS_STATS_H
+#define HEADERS_STATS_H
+
+// NOTE: live runtime counters, one block per event loop thread. A block is only written by the thread that registered
+// it, with relaxed stores and no locked instruction on the hot path, and read by the admin thread with relaxed loads,
+// so a snapshot never stops a loop (the fields of a block may be a few events apart from each other). The threads that
+// don't register (a thread per connection) share a block updated with atomic adds.
+//
+// the snapshot is served on a unix domain socket, every connection gets the current numbers as text and is closed
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "log.h"
+
+#define STATS_MAX_THREADS 256
+#define STATS_NAME_SIZE 32
+// NOTE: log2 buckets, bucket i holds the values in [2^(i-1), 2^i) and bucket 0 the zeros
+#define STATS_HIST_BUCKETS 33
+// NOTE: the admin thread waits this long after a failed accept (EMFILE, ENOMEM, ...) before the next one
+#define STATS_ADMIN_BACKOFF_MS 100
+
+typedef struct {
+    uint64_t buckets[STATS_HIST_BUCKETS];
+} stats_hist_t;
+
+typedef struct {
+    char name[STATS_NAME_SIZE];
+    // NOTE: peers taken over by the thread and the ones it closed, the difference is how many it's serving
+    uint64_t accepts;
+    uint64_t closes;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // NOTE: socket and readiness syscalls issued by the thread (accept, recv, send, epoll_wait, epoll_ctl, ...)
+    uint64_t syscalls;
+    uint64_t loop_iterations;
+    // NOTE: ready events handed by each epoll_wait/select call or completions by each io_uring_enter
+    stats_hist_t events_per_wait;
+    // NOTE: bytes left on a peer send queue after its output was queued
+    stats_hist_t send_queue_depth;
+    // NOTE: microseconds spent handling the events of a loop iteration, the wait isn't counted
+    stats_hist_t loop_time_us;
+} __attribute__((aligned(64))) thread_stats_t;
+
+static thread_stats_t stats_shared = {.name = "shared"};
+static thread_stats_t* stats_threads[STATS_MAX_THREADS];
+static int stats_nthreads = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread thread_stats_t* stats_current = &stats_shared;
+static uint64_t stats_started_ns = 0;
+
+uint64_t
+stats_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// NOTE: gives the calling thread a block of its own, past STATS_MAX_THREADS it keeps using the shared one
+thread_stats_t*
+stats_register(const char* name) {
+    thread_stats_t* stats;
+
+    if (posix_memalign((void**) &stats, 64, sizeof(thread_stats_t)) != 0) {
+        errlog("error to allocate memory");
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    snprintf(stats->name, sizeof(stats->name), "%s", name);
+
+    pthread_mutex_lock(&stats_lock);
+
+    if (stats_nthreads == STATS_MAX_THREADS) {
+        pthread_mutex_unlock(&stats_lock);
+        free(stats);
+
+        return stats_current;
+    }
+
+    stats_threads[stats_nthreads] = stats;
+
+    // NOTE: the block is published after it's initialized, the admin thread loads the count with acquire
+    __atomic_store_n(&stats_nthreads, stats_nthreads + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_current = stats;
+
+    return stats;
+}
+
+void
+stats_add(uint64_t* counter, uint64_t n) {
+    if (stats_current == &stats_shared) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+}
+
+void
+stats_hist_add(stats_hist_t* hist, uint64_t value) {
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+
+    stats_add(&hist->buckets[bucket < STATS_HIST_BUCKETS ? bucket : STATS_HIST_BUCKETS - 1], 1);
+}
+
+// NOTE: a loop iteration is done, started_ns is when its wait returned
+void
+stats_loop_iteration(uint64_t started_ns) {
+    stats_add(&stats_current->loop_iterations, 1);
+    stats_hist_add(&stats_current->loop_time_us, (stats_clock_ns() - started_ns) / 1000);
+}
+
+void
+stats_hist_merge(stats_hist_t* total, const stats_hist_t* hist) {
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        total->buckets[i] += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+void
+stats_merge(thread_stats_t* total, const thread_stats_t* stats) {
+    total->accepts += __atomic_load_n(&stats->accepts, __ATOMIC_RELAXED);
+    total->closes += __atomic_load_n(&stats->closes, __ATOMIC_RELAXED);
+    total->bytes_in += __atomic_load_n(&stats->bytes_in, __ATOMIC_RELAXED);
+    total->bytes_out += __atomic_load_n(&stats->bytes_out, __ATOMIC_RELAXED);
+    total->syscalls += __atomic_load_n(&stats->syscalls, __ATOMIC_RELAXED);
+    total->loop_iterations += __atomic_load_n(&stats->loop_iterations, __ATOMIC_RELAXED);
+
+    stats_hist_merge(&total->events_per_wait, &stats->events_per_wait);
+    stats_hist_merge(&total->send_queue_depth, &stats->send_queue_depth);
+    stats_hist_merge(&total->loop_time_us, &stats->loop_time_us);
+}
+
+// NOTE: only the non-empty buckets, as <upper bound>:count (the zeros are on <1). Nothing for an empty histogram
+void
+stats_hist_print(const char* name, const stats_hist_t* hist, FILE* out) {
+    bool empty = true;
+
+    for (int i = 0; i < STATS_HIST_BUCKETS && empty; i++) {
+        empty = hist->buckets[i] == 0;
+    }
+
+    if (empty) {
+        return;
+    }
+
+    fprintf(out, "  %-16s", name);
+
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        if (hist->buckets[i] > 0) {
+            fprintf(out, " <%llu:%lu", 1ull << i, hist->buckets[i]);
+        }
+    }
+
+    fprintf(out, "\n");
+}
+
+void
+stats_print_thread(const char* label, const thread_stats_t* stats, FILE* out) {
+    fprintf(out,
+            "%s accepts=%lu active=%ld bytes_in=%lu bytes_out=%lu syscalls=%lu iterations=%lu\n",
+            label,
+            stats->accepts,
+            (int64_t) (stats->accepts - stats->closes),
+            stats->bytes_in,
+            stats->bytes_out,
+            stats->syscalls,
+            stats->loop_iterations);
+
+    stats_hist_print("events_per_wait", &stats->events_per_wait, out);
+    stats_hist_print("send_queue_depth", &stats->send_queue_depth, out);
+    stats_hist_print("loop_time_us", &stats->loop_time_us, out);
+}
+
+void
+stats_print(FILE* out) {
+    thread_stats_t total;
+    char label[STATS_NAME_SIZE + 32];
+    int nthreads = __atomic_load_n(&stats_nthreads, __ATOMIC_ACQUIRE);
+
+    memset(&total, 0, sizeof(total));
+
+    fprintf(out, "uptime_ms=%lu threads=%d\n", (stats_clock_ns() - stats_started_ns) / 1000000, nthreads);
+
+    for (int i = 0; i < nthreads; i++) {
+        thread_stats_t snapshot;
+
+        memset(&snapshot, 0, sizeof(snapshot));
+        stats_merge(&snapshot, stats_threads[i]);
+
+        snprintf(label, sizeof(label), "thread %d (%s)", i, stats_threads[i]->name);
+        stats_print_thread(label, &snapshot, out);
+        stats_merge(&total, stats_threads[i]);
+    }
+
+    thread_stats_t shared;
+
+    memset(&shared, 0, sizeof(shared));
+    stats_merge(&shared, &stats_shared);
+
+    if (shared.accepts > 0 || shared.syscalls > 0) {
+        stats_print_thread("shared", &shared, out);
+        stats_merge(&total, &stats_shared);
+    }
+
+    stats_print_thread("total", &total, out);
+}
+
+// NOTE: the snapshot is rendered in memory and sent with MSG_NOSIGNAL, a client leaving early can't raise SIGPIPE
+void*
+stats_admin_loop(void* arg) {
+    int admin_fd = (int) (intptr_t) arg;
+    struct timespec backoff = {.tv_sec = 0, .tv_nsec = STATS_ADMIN_BACKOFF_MS * 1000000};
+
+    while (1) {
+        int fd = accept(admin_fd, NULL, NULL);
+
+        if (fd == -1) {
+            // NOTE: a lasting error (out of descriptors) fails every accept at once, retrying right away would spin
+            if (errno != EINTR && errno != ECONNABORTED) {
+                log_error("%s:%d: error to accept stats connection: %s", __FILE__, __LINE__, strerror(errno));
+
+                nanosleep(&backoff, NULL);
+            }
+
+            continue;
+        }
+
+        char* snapshot = NULL;
+        size_t snapshot_len = 0;
+        FILE* out = open_memstream(&snapshot, &snapshot_len);
+
+        if (out != NULL) {
+            stats_print(out);
+            fclose(out);
+
+            for (size_t sent = 0; sent < snapshot_len;) {
+                ssize_t sent_len = send(fd, &snapshot[sent], snapshot_len - sent, MSG_NOSIGNAL);
+
+                if (sent_len <= 0) {
+                    break;
+                }
+
+                sent += sent_len;
+            }
+
+            free(snapshot);
+        }
+
+        close(fd);
+    }
+
+    return 0;
+}
+
+void
+stats_init(void) {
+    stats_started_ns = stats_clock_ns();
+}
+
+// NOTE: serve the snapshots on a unix domain socket at path, e.g. `nc -U path`. A stale socket file left by a previous
+// run is replaced
+void
+stats_admin_start(const char* path) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errlog("admin socket path too long: %s", path);
+    }
+
+    strcpy(addr.sun_path, path);
+
+    int admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (admin_fd == -1) {
+        errlog("error to create the admin socket");
+    }
+
+    unlink(path);
+
+    if (bind(admin_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        errlog("error to bind the admin socket on %s", path);
+    }
+
+    if (listen(admin_fd, 16) == -1) {
+        errlog("error on listen admin socket");
+    }
+
+    pthread_t admin_thread;
+
+    if (pthread_create(&admin_thread, NULL, stats_admin_loop, (void*) (intptr_t) admin_fd) != 0) {
+        errlog("error to create the admin thread");
+    }
+
+    pthread_detach(admin_thread);
+
+    printf("admin socket listening on %s\n", path);
+}
+
+#endif
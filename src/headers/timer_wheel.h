@@ -0,0 +1,205 @@
+#ifndef HEADERS_TIMER_WHEEL_H
+#define HEADERS_TIMER_WHEEL_H
+
+// NOTE: hierarchical timing wheel (Varghese & Lauck). 4 levels of 64 slots, a timer lands on the level that can hold
+// its distance to now and is cascaded down to the finer levels as the wheel turns, so adding and firing are O(1) and
+// the loop only wakes up when a slot is due. Timers are never removed, the owner of a cancelled entry just drops it
+// when it fires.
+// The wheel counts ticks of TIMER_WHEEL_TICK_MS from whatever clock the loop passes in
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "error.h"
+
+#define TIMER_WHEEL_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_MAX_TICKS ((1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef struct {
+    // NOTE: identifies the owner, a fd or a pointer
+    uintptr_t key;
+    uint32_t expire;
+} timer_entry_t;
+
+typedef struct {
+    timer_entry_t* entries;
+    uint32_t len;
+    uint32_t cap;
+} timer_slot_t;
+
+typedef struct {
+    timer_slot_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    // NOTE: every tick up to now was already processed
+    uint32_t now;
+    size_t count;
+} timer_wheel_t;
+
+typedef void (*timer_wheel_fn)(timer_entry_t* entry, void* arg);
+
+// NOTE: current tick of the monotonic clock
+uint32_t
+timer_wheel_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint32_t) ((uint64_t) ts.tv_sec * 1000 / TIMER_WHEEL_TICK_MS + ts.tv_nsec / 1000000 / TIMER_WHEEL_TICK_MS);
+}
+
+uint32_t
+timer_wheel_ticks(uint32_t ms) {
+    return (ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+}
+
+timer_wheel_t*
+timer_wheel_create(uint32_t now) {
+    timer_wheel_t* wheel = (timer_wheel_t*) calloc(1, sizeof(timer_wheel_t));
+
+    if (wheel == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    wheel->now = now;
+
+    return wheel;
+}
+
+void
+timer_wheel_destroy(timer_wheel_t* wheel) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            free(wheel->slots[level][slot].entries);
+        }
+    }
+
+    free(wheel);
+}
+
+void
+timer_slot_push(timer_slot_t* slot, timer_entry_t entry) {
+    if (slot->len == slot->cap) {
+        uint32_t cap = slot->cap > 0 ? slot->cap * 2 : 8;
+        timer_entry_t* entries = (timer_entry_t*) realloc(slot->entries, cap * sizeof(timer_entry_t));
+
+        if (entries == NULL) {
+            errlog("error to allocate memory");
+        }
+
+        slot->entries = entries;
+        slot->cap = cap;
+    }
+
+    slot->entries[slot->len++] = entry;
+}
+
+// NOTE: a timer due on the current tick lands on the level 0 slot of now, only the cascades do it right before that
+// slot is run
+void
+timer_wheel_insert(timer_wheel_t* wheel, timer_entry_t entry) {
+    uint32_t delta = entry.expire - wheel->now;
+    int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1u << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    timer_slot_push(&wheel->slots[level][(entry.expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], entry);
+
+    wheel->count++;
+}
+
+// NOTE: an expire that is already due fires on the next tick
+void
+timer_wheel_add(timer_wheel_t* wheel, uintptr_t key, uint32_t expire) {
+    uint32_t delta = expire - wheel->now;
+
+    if ((int32_t) delta <= 0) {
+        delta = 1;
+    } else if (delta > TIMER_WHEEL_MAX_TICKS) {
+        delta = TIMER_WHEEL_MAX_TICKS;
+    }
+
+    timer_entry_t entry = {.key = key, .expire = wheel->now + delta};
+
+    timer_wheel_insert(wheel, entry);
+}
+
+// NOTE: the slot is detached before the entries are handled, the callback may add timers to the wheel
+void
+timer_wheel_run_slot(timer_wheel_t* wheel, int level, int index, timer_wheel_fn fn, void* arg) {
+    timer_slot_t slot = wheel->slots[level][index];
+
+    if (slot.len == 0) {
+        return;
+    }
+
+    wheel->slots[level][index] = (timer_slot_t) {0};
+    wheel->count -= slot.len;
+
+    for (uint32_t i = 0; i < slot.len; i++) {
+        if (level == 0) {
+            fn(&slot.entries[i], arg);
+        } else {
+            timer_wheel_insert(wheel, slot.entries[i]);
+        }
+    }
+
+    // NOTE: give the array back to keep its capacity when nothing was added to the slot meanwhile
+    if (wheel->slots[level][index].entries == NULL) {
+        slot.len = 0;
+        wheel->slots[level][index] = slot;
+    } else {
+        free(slot.entries);
+    }
+}
+
+// NOTE: fire every timer up to the tick now, cascading the coarser levels on their boundaries
+void
+timer_wheel_advance(timer_wheel_t* wheel, uint32_t now, timer_wheel_fn fn, void* arg) {
+    while ((int32_t) (now - wheel->now) > 0) {
+        if (wheel->count == 0) {
+            wheel->now = now;
+
+            break;
+        }
+
+        uint32_t tick = ++wheel->now;
+
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((tick & ((1u << (TIMER_WHEEL_BITS * level)) - 1)) == 0) {
+                timer_wheel_run_slot(wheel, level, (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK, fn, arg);
+            }
+        }
+
+        timer_wheel_run_slot(wheel, 0, tick & TIMER_WHEEL_MASK, fn, arg);
+    }
+}
+
+// NOTE: how long the loop may block, until the next non-empty slot or the next cascade. -1 when there's no timer
+int
+timer_wheel_timeout_ms(const timer_wheel_t* wheel, uint32_t now) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    uint32_t ticks = TIMER_WHEEL_SLOTS - (wheel->now & TIMER_WHEEL_MASK);
+
+    for (uint32_t i = 1; i < ticks; i++) {
+        if (wheel->slots[0][(wheel->now + i) & TIMER_WHEEL_MASK].len > 0) {
+            ticks = i;
+
+            break;
+        }
+    }
+
+    uint32_t elapsed = (int32_t) (now - wheel->now) > 0 ? now - wheel->now : 0;
+
+    return elapsed >= ticks ? 0 : (int) ((ticks - elapsed) * TIMER_WHEEL_TICK_MS);
+}
+
+#endif
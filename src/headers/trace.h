@@ -0,0 +1,312 @@
+#ifndef HEADERS_TRACE_H
+#define HEADERS_TRACE_H
+
+// NOTE: per-request latency tracing, only compiled in with -DTRACE (make build TRACE=1), otherwise TRACE_PEER expands
+// to nothing. Every thread records timestamped events of its peers on a ring of its own: a single writer that bumps the
+// head with a release store after filling the slot, and overwrites the oldest events once the ring is full, so
+// recording is a TSC read and a 16 bytes store. The rings are dumped to a file on SIGUSR2 by a thread blocked on
+// sigwait, the reader copies a ring while it's being written and drops the slots the writer lapped meanwhile.
+//
+// a peer is identified by the address of its state, only the peers whose id falls on the sample are traced. The dump
+// is turned into a Chrome/Perfetto trace by build/tracedump
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TRACE_MAGIC 0x31435254
+#define TRACE_NAME_SIZE 32
+
+typedef enum {
+    TRACE_ACCEPT = 1,
+    // NOTE: bytes received and handed to the state machine
+    TRACE_RECV,
+    // NOTE: state of the '^'/'$' machine after a received chunk, when it changed
+    TRACE_STATE,
+    // NOTE: transformed bytes appended to the send queue
+    TRACE_SEND_QUEUED,
+    // NOTE: bytes the kernel took from the send queue
+    TRACE_SEND_DONE,
+    TRACE_CLOSE,
+} trace_event_type_t;
+
+typedef struct {
+    // NOTE: nanoseconds on the dump, TSC ticks on the ring
+    uint64_t ts;
+    uint32_t peer;
+    // NOTE: trace_event_type_t on the top 8 bits, the byte count or the state on the low 24 (saturated)
+    uint32_t info;
+} trace_event_t;
+
+// NOTE: dump file layout: the header, then for every ring a trace_dump_ring_t followed by its events, oldest first
+typedef struct {
+    uint32_t magic;
+    uint32_t nrings;
+} trace_dump_header_t;
+
+typedef struct {
+    char name[TRACE_NAME_SIZE];
+    uint32_t id;
+    uint32_t nevents;
+} trace_dump_ring_t;
+
+trace_event_type_t
+trace_event_type(const trace_event_t* event) {
+    return (trace_event_type_t) (event->info >> 24);
+}
+
+uint32_t
+trace_event_arg(const trace_event_t* event) {
+    return event->info & 0xffffff;
+}
+
+#ifdef TRACE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "error.h"
+#include "stats.h"
+
+// NOTE: 256 KB per thread, the thread-per-connection modes stop tracing past TRACE_MAX_RINGS threads
+#define TRACE_RING_SIZE (16 * 1024)
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+#define TRACE_MAX_RINGS 256
+
+typedef struct {
+    uint64_t head;
+    char name[TRACE_NAME_SIZE];
+    trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static trace_ring_t* trace_rings[TRACE_MAX_RINGS];
+static int trace_nrings = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring_t* trace_current = NULL;
+static __thread bool trace_disabled = false;
+static const char* trace_path = NULL;
+// NOTE: one peer in trace_sample is traced
+static uint32_t trace_sample = 1;
+// NOTE: pairs of TSC and monotonic clock taken at start and on every dump to convert the ticks
+static uint64_t trace_start_ticks = 0;
+static uint64_t trace_start_ns = 0;
+
+uint64_t
+trace_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return trace_clock_ns();
+#endif
+}
+
+// NOTE: the ring of the calling thread, created on its first event and named after the stats block of the thread
+trace_ring_t*
+trace_ring_get(void) {
+    if (trace_current != NULL || trace_disabled) {
+        return trace_current;
+    }
+
+    trace_ring_t* ring = (trace_ring_t*) calloc(1, sizeof(trace_ring_t));
+
+    if (ring == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    snprintf(ring->name, sizeof(ring->name), "%s", stats_current->name);
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_nrings == TRACE_MAX_RINGS) {
+        pthread_mutex_unlock(&trace_lock);
+        free(ring);
+
+        trace_disabled = true;
+
+        return NULL;
+    }
+
+    trace_rings[trace_nrings] = ring;
+
+    __atomic_store_n(&trace_nrings, trace_nrings + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_current = ring;
+
+    return ring;
+}
+
+void
+trace_record(trace_event_type_t type, const void* peer, uint32_t arg) {
+    uint32_t id = (uint32_t) ((uintptr_t) peer >> 6);
+
+    if (trace_path == NULL || (trace_sample > 1 && id % trace_sample != 0)) {
+        return;
+    }
+
+    trace_ring_t* ring = trace_ring_get();
+
+    if (ring == NULL) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    trace_event_t* event = &ring->events[head & TRACE_RING_MASK];
+
+    event->ts = trace_ticks();
+    event->peer = id;
+    event->info = ((uint32_t) type << 24) | (arg > 0xffffff ? 0xffffff : arg);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// NOTE: copies what's left of the ring on events, returns how many were kept
+uint32_t
+trace_ring_snapshot(const trace_ring_t* ring, trace_event_t* events) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    for (uint64_t i = start; i < head; i++) {
+        events[i - start] = ring->events[i & TRACE_RING_MASK];
+    }
+
+    // NOTE: the slots the writer reused while they were copied are torn, they're dropped. The slot of the event at
+    // lapped may be half written
+    uint64_t lapped = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = lapped >= TRACE_RING_SIZE ? lapped - TRACE_RING_SIZE + 1 : 0;
+
+    if (first > start) {
+        if (first >= head) {
+            return 0;
+        }
+
+        memmove(events, &events[first - start], (head - first) * sizeof(trace_event_t));
+        start = first;
+    }
+
+    return (uint32_t) (head - start);
+}
+
+void
+trace_dump(const char* path) {
+    uint64_t now_ticks = trace_ticks();
+    uint64_t now_ns = trace_clock_ns();
+    double ns_per_tick = now_ticks > trace_start_ticks
+                             ? (double) (now_ns - trace_start_ns) / (double) (now_ticks - trace_start_ticks)
+                             : 1.0;
+
+    FILE* out = fopen(path, "wb");
+
+    if (out == NULL) {
+        fprintf(stderr, "%s:%d: error to open the trace dump %s\n", __FILE__, __LINE__, path);
+
+        return;
+    }
+
+    trace_event_t* events = (trace_event_t*) malloc(TRACE_RING_SIZE * sizeof(trace_event_t));
+
+    if (events == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    trace_dump_header_t header = {.magic = TRACE_MAGIC, .nrings = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE)};
+
+    fwrite(&header, sizeof(header), 1, out);
+
+    for (uint32_t i = 0; i < header.nrings; i++) {
+        trace_dump_ring_t ring = {.id = i};
+
+        memcpy(ring.name, trace_rings[i]->name, sizeof(ring.name));
+
+        ring.nevents = trace_ring_snapshot(trace_rings[i], events);
+
+        for (uint32_t k = 0; k < ring.nevents; k++) {
+            events[k].ts = (uint64_t) ((double) (events[k].ts - trace_start_ticks) * ns_per_tick);
+        }
+
+        fwrite(&ring, sizeof(ring), 1, out);
+        fwrite(events, sizeof(trace_event_t), ring.nevents, out);
+    }
+
+    free(events);
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "%s:%d: error to write the trace dump %s\n", __FILE__, __LINE__, path);
+
+        return;
+    }
+
+    printf("trace dumped to %s (%u threads)\n", path, header.nrings);
+}
+
+void*
+trace_dump_loop(void* arg) {
+    sigset_t* signals = (sigset_t*) arg;
+
+    while (1) {
+        int signal;
+
+        if (sigwait(signals, &signal) == 0) {
+            trace_dump(trace_path);
+        }
+    }
+
+    return 0;
+}
+
+// NOTE: must run before any other thread is created, they inherit the blocked SIGUSR2 and only the dump thread gets it
+void
+trace_start(const char* path, uint32_t sample) {
+    static sigset_t signals;
+
+    trace_start_ticks = trace_ticks();
+    trace_start_ns = trace_clock_ns();
+    trace_sample = sample > 0 ? sample : 1;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        errlog("error to block the trace dump signal");
+    }
+
+    pthread_t dump_thread;
+
+    if (pthread_create(&dump_thread, NULL, trace_dump_loop, &signals) != 0) {
+        errlog("error to create the trace dump thread");
+    }
+
+    pthread_detach(dump_thread);
+
+    trace_path = path;
+
+    printf("tracing one peer in %u, kill -USR2 %d dumps to %s\n", trace_sample, (int) getpid(), path);
+}
+
+#define TRACE_PEER(type, peer, arg) trace_record((type), (peer), (arg))
+
+#else
+
+#define TRACE_PEER(type, peer, arg) ((void) 0)
+
+#endif
+
+#endif
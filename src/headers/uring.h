@@ -0,0 +1,237 @@
+#ifndef HEADERS_URING_H
+#define HEADERS_URING_H
+
+// NOTE: a minimal io_uring wrapper over the raw syscalls, only what the proactor server needs: submission and
+// completion rings and a provided buffer ring. Kernel and userspace share the ring memory, the head/tail indexes must
+// be accessed with acquire/release ordering
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "stats.h"
+
+typedef struct {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    // NOTE: local tail, only published to the kernel on submit so sqes can be batched
+    unsigned sqe_tail;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+} uring_t;
+
+typedef struct {
+    struct io_uring_buf_ring* ring;
+    unsigned entries;
+    uint8_t* bufs;
+    unsigned buf_size;
+    unsigned short tail;
+} uring_buf_ring_t;
+
+void
+uring_init(uring_t* uring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+
+    uring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (uring->ring_fd == -1) {
+        errlog("error to setup io_uring");
+    }
+
+    size_t sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // NOTE: since 5.4 both rings live in a single mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size) {
+            sq_ring_size = cq_ring_size;
+        }
+
+        cq_ring_size = sq_ring_size;
+    }
+
+    uint8_t* sq_ring = mmap(
+        NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+
+    if (sq_ring == MAP_FAILED) {
+        errlog("error to map io_uring submission ring");
+    }
+
+    uint8_t* cq_ring = sq_ring;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ring = mmap(
+            NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+
+        if (cq_ring == MAP_FAILED) {
+            errlog("error to map io_uring completion ring");
+        }
+    }
+
+    uring->sqes = mmap(NULL,
+                       params.sq_entries * sizeof(struct io_uring_sqe),
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       uring->ring_fd,
+                       IORING_OFF_SQES);
+
+    if (uring->sqes == MAP_FAILED) {
+        errlog("error to map io_uring submission entries");
+    }
+
+    uring->sq_entries = params.sq_entries;
+    uring->sq_head = (unsigned*) (sq_ring + params.sq_off.head);
+    uring->sq_tail = (unsigned*) (sq_ring + params.sq_off.tail);
+    uring->sq_mask = (unsigned*) (sq_ring + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned*) (sq_ring + params.sq_off.array);
+    uring->sqe_tail = *uring->sq_tail;
+
+    uring->cq_head = (unsigned*) (cq_ring + params.cq_off.head);
+    uring->cq_tail = (unsigned*) (cq_ring + params.cq_off.tail);
+    uring->cq_mask = (unsigned*) (cq_ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+}
+
+int
+uring_enter(uring_t* uring, unsigned to_submit, unsigned wait_nr) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    while (1) {
+        int rc = syscall(__NR_io_uring_enter, uring->ring_fd, to_submit, wait_nr, flags, NULL, 0);
+
+        stats_add(&stats_current->syscalls, 1);
+
+        if (rc >= 0 || errno != EINTR) {
+            return rc;
+        }
+    }
+}
+
+// NOTE: publish every queued sqe with a single syscall and wait for at least wait_nr completions
+int
+uring_submit_and_wait(uring_t* uring, unsigned wait_nr) {
+    unsigned to_submit = uring->sqe_tail - *uring->sq_tail;
+
+    __atomic_store_n(uring->sq_tail, uring->sqe_tail, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    int rc = uring_enter(uring, to_submit, wait_nr);
+
+    if (rc == -1 && errno != EBUSY) {
+        errlog("error to submit io_uring entries");
+    }
+
+    return rc;
+}
+
+struct io_uring_sqe*
+uring_get_sqe(uring_t* uring) {
+    // NOTE: submission ring full, flush it to the kernel before taking a new entry
+    if (uring->sqe_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+        uring_submit_and_wait(uring, 0);
+    }
+
+    unsigned idx = uring->sqe_tail & *uring->sq_mask;
+    struct io_uring_sqe* sqe = &uring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    uring->sq_array[idx] = idx;
+    uring->sqe_tail++;
+
+    return sqe;
+}
+
+struct io_uring_cqe*
+uring_peek_cqe(uring_t* uring) {
+    unsigned head = *uring->cq_head;
+
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &uring->cqes[head & *uring->cq_mask];
+}
+
+void
+uring_cqe_seen(uring_t* uring) {
+    __atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t*
+uring_buf_ring_get(uring_buf_ring_t* buf_ring, unsigned short bid) {
+    return &buf_ring->bufs[(size_t) bid * buf_ring->buf_size];
+}
+
+// NOTE: hand a buffer back to the kernel once its data was consumed
+void
+uring_buf_ring_add(uring_buf_ring_t* buf_ring, unsigned short bid) {
+    struct io_uring_buf* buf = &buf_ring->ring->bufs[buf_ring->tail & (buf_ring->entries - 1)];
+
+    buf->addr = (unsigned long) uring_buf_ring_get(buf_ring, bid);
+    buf->len = buf_ring->buf_size;
+    buf->bid = bid;
+
+    buf_ring->tail++;
+
+    __atomic_store_n(&buf_ring->ring->tail, buf_ring->tail, __ATOMIC_RELEASE);
+}
+
+// NOTE: a ring of equally sized buffers the kernel picks from when a recv completes, so memory is only consumed by
+// sockets that actually have data (instead of one buffer parked per armed recv)
+void
+uring_buf_ring_init(uring_t* uring, uring_buf_ring_t* buf_ring, unsigned short bgid, unsigned entries, unsigned size) {
+    size_t ring_size = entries * sizeof(struct io_uring_buf);
+
+    buf_ring->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if (buf_ring->ring == MAP_FAILED) {
+        errlog("error to allocate io_uring buffer ring");
+    }
+
+    buf_ring->bufs = (uint8_t*) malloc((size_t) entries * size);
+
+    if (buf_ring->bufs == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    buf_ring->entries = entries;
+    buf_ring->buf_size = size;
+    buf_ring->tail = 0;
+
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+
+    reg.ring_addr = (unsigned long) buf_ring->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+
+    if (syscall(__NR_io_uring_register, uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        errlog("error to register io_uring buffer ring");
+    }
+
+    for (unsigned bid = 0; bid < entries; bid++) {
+        uring_buf_ring_add(buf_ring, bid);
+    }
+}
+
+#endif
@@ -1,39 +1,137 @@
 const net = require('net');
+const os = require('os');
+const path = require('path');
+const { Worker } = require('worker_threads');
 const { buf2num, isPrime } = require('./utils');
-const { fork } = require('child_process');
 
 const port = 8081;
 const server = net.createServer();
 
+// NOTE: the workers are started once and reused, a job waits on the queue while every worker is busy and is
+// refused once the queue is full, so a burst can't grow the memory of the server without bound
+const poolSize = parseInt(process.env.POOL_SIZE, 10) || os.cpus().length;
+const maxQueue = parseInt(process.env.POOL_MAX_QUEUE, 10) || 1024;
+
+
+function createPool(size, maxQueue) {
+   const idle = [];
+   const queue = [];
+   // NOTE: job id -> { resolve, reject }, the replies of the workers are matched by id
+   const pending = new Map();
+   let nextId = 0;
+   // NOTE: a worker dying soon after its start is replaced later and later, up to a second, so a worker failing at
+   // startup doesn't respawn in a tight loop
+   let respawnDelay = 0;
+
+   function dispatch() {
+      while (idle.length > 0 && queue.length > 0) {
+         const worker = idle.pop();
+         const job = queue.shift();
+
+         worker.jobId = job.id;
+         worker.postMessage({ id: job.id, num: job.num });
+      }
+   }
+
+   function settle(id, err, result) {
+      const job = pending.get(id);
+
+      if (job === undefined) return;
+
+      pending.delete(id);
+
+      if (err) job.reject(err);
+      else job.resolve(result);
+   }
+
+   function spawn() {
+      const worker = new Worker(path.join(__dirname, 'worker.js'));
+
+      worker.jobId = null;
+      worker.startedAt = Date.now();
+
+      worker.on('message', ({ id, result }) => {
+         worker.jobId = null;
+         idle.push(worker);
+
+         settle(id, null, result);
+         dispatch();
+      });
+
+      // NOTE: a worker that died takes its job with it, it's replaced so the pool keeps its size
+      worker.on('error', err => {
+         console.log('worker %d error: %s', worker.threadId, err.message);
+
+         if (worker.jobId !== null) settle(worker.jobId, err);
+      });
+
+      // NOTE: a worker may also exit without an error event, its job is failed either way (a no-op once settled)
+      worker.once('exit', () => {
+         const i = idle.indexOf(worker);
+
+         if (i !== -1) idle.splice(i, 1);
+
+         if (worker.jobId !== null) settle(worker.jobId, new Error('worker exited'));
+
+         if (Date.now() - worker.startedAt < 1000) respawnDelay = Math.min(respawnDelay * 2 || 10, 1000);
+         else respawnDelay = 0;
+
+         setTimeout(() => {
+            spawn();
+            dispatch();
+         }, respawnDelay);
+      });
+
+      idle.push(worker);
+   }
+
+   for (let i = 0; i < size; i++) spawn();
+
+   function submit(num) {
+      if (queue.length >= maxQueue) {
+         return Promise.reject(new Error('queue full'));
+      }
+
+      const id = nextId++;
+
+      return new Promise((resolve, reject) => {
+         pending.set(id, { resolve, reject });
+         queue.push({ id, num });
+
+         dispatch();
+      });
+   }
+
+   return { submit };
+}
+
+const pool = createPool(poolSize, maxQueue);
+
 
 function handleConnection(conn) {
    const remoteAddr = `${conn.remoteAddress}:${conn.remotePort}`;
+   // NOTE: the answers of a connection are written in the order it asked, whatever worker finishes first
+   let lastResponse = Promise.resolve();
 
    console.log('peer %s connected', remoteAddr);
 
-   async function onData(data) {
+   function onData(data) {
       const num = buf2num(data);
 
       console.log('num %d', num);
 
-      const response = await new Promise((resolve, reject) => {
-         const worker = fork('./worker.js');
-
-         worker.send(num);
-         worker.on('message', message => {
-            const response = message.result ? 'prime' : 'composite';
-
-            resolve(response);
-         });
-
-         worker.on('error', message => { reject(message) });
-      });
+      const response = pool.submit(num).then(
+         result => result ? 'prime' : 'composite',
+         err => `error: ${err.message}`,
+      );
 
       // const response = isPrime(num) ? 'prime' : 'composite';
 
-      conn.write(response + '\n');
-
-      // console.log('... %d is %s', num, response);
+      lastResponse = lastResponse
+         .then(() => response)
+         .then(response => {
+            if (!conn.destroyed) conn.write(response + '\n');
+         });
    }
 
    function onClose () {
@@ -51,4 +149,4 @@ function handleConnection(conn) {
 
 server.on('connection', handleConnection);
 
-server.listen(port, () => console.log('listening on port: %d', port))
+server.listen(port, () => console.log('listening on port: %d (%d workers)', port, poolSize))
@@ -1,36 +1,189 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "blocking_sock_connection.c"
+#include "coroutine_server.c"
+#include "event_driven_epoll_acceptor_server.c"
+#include "event_driven_epoll_reactor_server.c"
 #include "event_driven_epoll_server.c"
 #include "event_driven_libuv_server.c"
+#include "event_driven_poll_server.c"
 #include "event_driven_select_server.c"
+#include "event_driven_uring_server.c"
 #include "headers/state_machine.h"
 #include "nonblocking_sock_connection.c"
+#include "prime_server.c"
 #include "sequential_server.c"
+#include "thread_pool_server.c"
 #include "thread_server.c"
 
+void
+usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [-m mode] [-n threads] [-z bytes] [-t idle[,read[,write]]] [-b backlog] [-d seconds] [-a path] "
+            "[-T path] [-S n] [-L level] [-P policy] [port]\n",
+            program);
+    fprintf(stderr,
+            "modes: sequential, thread, thread_pool, blocking, nonblocking, select, poll, epoll, epoll_et, "
+            "epoll_reactor, epoll_acceptor, uring, libuv, libuv_reactor, coro, prime, prime_libuv\n");
+    fprintf(stderr, "-n: also the compute workers of the prime modes\n");
+    fprintf(stderr, "-z: zerocopy sends of at least this many bytes (epoll and uring modes)\n");
+    fprintf(stderr,
+            "-t: peer timeouts in seconds, 0 disables (select, poll, epoll and libuv modes, default: 60,10,30)\n");
+    fprintf(stderr, "-b: listen backlog (default: %d)\n", N_BACKLOG);
+    fprintf(stderr, "-d: TCP_DEFER_ACCEPT seconds, 0 disables (default: 0)\n");
+    fprintf(stderr, "-a: unix socket serving the runtime stats, e.g. nc -U path (default: off)\n");
+    fprintf(stderr, "-T: trace the peers, kill -USR2 dumps the trace rings to path (TRACE=1 builds only)\n");
+    fprintf(stderr, "-S: trace one peer in n (default: 1)\n");
+    fprintf(stderr, "-L: log level: debug, info, warn or error (default: info)\n");
+    fprintf(stderr, "-P: how the epoll_acceptor mode assigns connections to workers: least or rr (default: least)\n");
+
+    exit(EXIT_FAILURE);
+}
+
+// NOTE: idle[,read[,write]] in seconds, the timeouts left out keep their defaults
+void
+parse_timeouts(const char* arg) {
+    unsigned idle = peer_idle_timeout_ms / 1000;
+    unsigned read = peer_read_timeout_ms / 1000;
+    unsigned write = peer_write_timeout_ms / 1000;
+
+    if (sscanf(arg, "%u,%u,%u", &idle, &read, &write) < 1) {
+        errlog("invalid timeouts: %s", arg);
+    }
+
+    peer_idle_timeout_ms = idle * 1000;
+    peer_read_timeout_ms = read * 1000;
+    peer_write_timeout_ms = write * 1000;
+}
+
 int
 main(int argc, char** argv) {
-    setvbuf(stdout, NULL, _IONBF, 0);
-
     int port = 8081;
+    int nthreads = 4;
+    const char* mode = "libuv";
+    const char* admin_path = NULL;
+    const char* trace_dump_path = NULL;
+    uint32_t trace_sample_rate = 1;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:n:z:t:b:d:a:T:S:L:P:")) != -1) {
+        switch (opt) {
+            case 'm':
+                mode = optarg;
+                break;
+            case 'n':
+                nthreads = atoi(optarg);
+                break;
+            case 'z':
+                send_queue_zerocopy_threshold = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                parse_timeouts(optarg);
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                break;
+            case 'd':
+                tcp_defer_accept_secs = atoi(optarg);
+                break;
+            case 'a':
+                admin_path = optarg;
+                break;
+            case 'T':
+                trace_dump_path = optarg;
+                break;
+            case 'S':
+                trace_sample_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                if (!log_parse_level(optarg, &log_level)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'P':
+                if (!acceptor_parse_policy(optarg, &acceptor_policy)) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
 
-    if (argc >= 2) {
-        port = atoi(argv[1]);
+    if (optind < argc) {
+        port = atoi(argv[optind]);
     }
 
-    printf("server listen on port: %d\n", port);
+    printf("server listen on port: %d (mode: %s)\n", port, mode);
 
-    /* int sockfd = listen_inet_socket(port); */
+    stats_init();
 
-    /* sequential_server(sockfd); */
-    /* thread_server(sockfd); */
-    /* blocking_sock_connection(sockfd); */
-    /* nonblocking_sock_connection(sockfd); */
-    /* event_driven_select_server(sockfd); */
-    /* event_driven_epoll_server(sockfd); */
-    event_driven_libuv_server(port);
+    // NOTE: before any thread is created, see trace_start
+    if (trace_dump_path != NULL) {
+#ifdef TRACE
+        trace_start(trace_dump_path, trace_sample_rate);
+#else
+        UNUSED(trace_sample_rate)
+        errlog("tracing is compiled out, build with TRACE=1");
+#endif
+    }
+
+    log_start();
+
+    if (admin_path != NULL) {
+        stats_admin_start(admin_path);
+    }
+
+    // NOTE: these modes open their own listening sockets
+    if (strcmp(mode, "libuv") == 0) {
+        return event_driven_libuv_server(port, 1);
+    } else if (strcmp(mode, "libuv_reactor") == 0) {
+        return event_driven_libuv_server(port, nthreads);
+    } else if (strcmp(mode, "epoll_reactor") == 0) {
+        event_driven_epoll_reactor_server(port, nthreads);
+
+        return 0;
+    } else if (strcmp(mode, "coro") == 0) {
+        coroutine_server(port, nthreads);
+
+        return 0;
+    } else if (strcmp(mode, "prime_libuv") == 0) {
+        return prime_libuv_server(port, nthreads);
+    }
+
+    int sockfd = listen_inet_socket(port, false);
+
+    if (strcmp(mode, "sequential") == 0) {
+        sequential_server(sockfd);
+    } else if (strcmp(mode, "thread") == 0) {
+        thread_server(sockfd);
+    } else if (strcmp(mode, "thread_pool") == 0) {
+        thread_pool_server(sockfd, nthreads);
+    } else if (strcmp(mode, "blocking") == 0) {
+        blocking_sock_connection(sockfd);
+    } else if (strcmp(mode, "nonblocking") == 0) {
+        nonblocking_sock_connection(sockfd);
+    } else if (strcmp(mode, "select") == 0) {
+        event_driven_select_server(sockfd);
+    } else if (strcmp(mode, "poll") == 0) {
+        event_driven_poll_server(sockfd);
+    } else if (strcmp(mode, "epoll") == 0) {
+        event_driven_epoll_server(sockfd);
+    } else if (strcmp(mode, "epoll_et") == 0) {
+        event_driven_epoll_et_server(sockfd);
+    } else if (strcmp(mode, "epoll_acceptor") == 0) {
+        event_driven_epoll_acceptor_server(sockfd, nthreads);
+    } else if (strcmp(mode, "uring") == 0) {
+        event_driven_uring_server(sockfd);
+    } else if (strcmp(mode, "prime") == 0) {
+        prime_epoll_server(sockfd, nthreads);
+    } else {
+        usage(argv[0]);
+    }
 
     return 0;
 }
@@ -36,7 +36,7 @@ nonblocking_sock_connection(int sockfd) {
     while (1) {
         uint8_t buf[1024];
 
-        printf("calling recv...\n");
+        log_info("calling recv...");
 
         int len = recv(sockfd_new, buf, sizeof(buf), 0);
 
@@ -47,11 +47,11 @@ nonblocking_sock_connection(int sockfd) {
                 continue;
             }
         } else if (len == 0) {
-            printf("peer disconnected, i'm done\n");
+            log_info("peer disconnected, i'm done");
             break;
         }
 
-        printf("recv returned %d bytes\n", len);
+        log_info("recv returned %d bytes", len);
     }
 
     close(sockfd_new);
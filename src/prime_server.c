@@ -0,0 +1,772 @@
+// NOTE: the prime checking protocol of the node server (src/index.js) on a single event loop, epoll or libuv. The node
+// server forks a process per request to keep the trial division off its loop, here every read is parsed into a batch
+// of numbers and the loop answers what it can from the sieve and the result cache. Only a batch with numbers left
+// becomes a job on the work-stealing compute pool, its answers come back through the completion queue of the loop (an
+// eventfd on epoll, an async handle on libuv) and the job fills the cache. A peer has at most one job in flight and
+// isn't read meanwhile, so its answers go out in the order it asked. A peer that floods requests without reading the
+// answers stops being read once its pending output passes the high watermark of the send queue (the write queue of the
+// handle on libuv) and is resumed below the low watermark, so it only fills its own socket buffer
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include "headers/compute_pool.h"
+#include "headers/error.h"
+#include "headers/lru_cache.h"
+#include "headers/pool.h"
+#include "headers/prime.h"
+#include "headers/send_queue.h"
+#include "headers/servers.h"
+#include "headers/stats.h"
+
+#define PRIME_MAX_EVENTS 1024
+#define PRIME_RECV_BUF_SIZE 4096
+#define PRIME_POOL_MAX_FREE 4096
+// NOTE: results kept for the numbers past the sieve, 16 bytes of value and links each plus the hash buckets
+#define PRIME_CACHE_SIZE (256 * 1024)
+// NOTE: strlen("composite\n")
+#define PRIME_ANSWER_MAX_LEN 10
+
+struct prime_loop;
+
+typedef struct {
+    // NOTE: first member, the completed job is the peer itself
+    compute_job_t job;
+    struct prime_loop* loop;
+    prime_parser_t parser;
+    // NOTE: the numbers of the last read and their prime_result_t, grown to the biggest batch of the peer
+    uint64_t* nums;
+    uint8_t* results;
+    size_t nnums;
+    size_t batch_cap;
+    bool job_inflight;
+    // NOTE: the peer finished sending, the connection closes once the last answer is out
+    bool read_closed;
+    // NOTE: reading is paused while the pending answers are above the high watermark
+    bool read_paused;
+    // NOTE: the connection is gone, the peer is released when its job comes back
+    bool closed;
+    // NOTE: epoll usage
+    int sockfd;
+    uint32_t epoll_events;
+    send_queue_t send_queue;
+    // NOTE: libuv usage
+    uv_tcp_t client;
+    uint32_t writes_inflight;
+} prime_peer_t;
+
+// NOTE: a write of libuv and the answers it carries, released when it completes
+typedef struct {
+    uv_write_t req;
+    prime_peer_t* peer;
+    char answers[];
+} prime_uv_write_t;
+
+typedef struct prime_loop {
+    compute_pool_t* compute;
+    compute_completion_t completion;
+    // NOTE: shared by the loop and the compute workers
+    lru_cache_t* cache;
+    pool_t peers;
+    // NOTE: epoll usage, the answers of a batch are rendered here before they're queued
+    int epollfd;
+    char answers[PRIME_RECV_BUF_SIZE * PRIME_ANSWER_MAX_LEN];
+    // NOTE: libuv usage, the read buffer is handed over to a single read at a time
+    uv_loop_t* uv_loop;
+    uv_async_t completion_handle;
+    char read_buf[PRIME_RECV_BUF_SIZE];
+} prime_loop_t;
+
+void
+prime_batch_reserve(prime_peer_t* peer, size_t n) {
+    if (n <= peer->batch_cap) {
+        return;
+    }
+
+    peer->nums = (uint64_t*) realloc(peer->nums, n * sizeof(uint64_t));
+    peer->results = (uint8_t*) realloc(peer->results, n * sizeof(uint8_t));
+    peer->batch_cap = n;
+
+    if (peer->nums == NULL || peer->results == NULL) {
+        errlog("error to allocate memory");
+    }
+}
+
+// NOTE: the lines ended on a read become the batch of the peer, returns how many
+size_t
+prime_batch_parse(prime_peer_t* peer, const uint8_t* buf, size_t len) {
+    size_t nlines = 0;
+
+    for (const uint8_t* nl = buf; (nl = memchr(nl, '\n', len - (nl - buf))) != NULL; nl++) {
+        nlines++;
+    }
+
+    prime_batch_reserve(peer, nlines);
+
+    peer->nnums = prime_parse_batch(&peer->parser, buf, len, peer->nums);
+
+    return peer->nnums;
+}
+
+// NOTE: the peer closed, what's left of its last line is a batch of its own
+size_t
+prime_batch_finish(prime_peer_t* peer) {
+    uint64_t num;
+
+    peer->nnums = 0;
+
+    if (prime_parse_finish(&peer->parser, &num)) {
+        prime_batch_reserve(peer, 1);
+
+        peer->nums[peer->nnums++] = num;
+    }
+
+    return peer->nnums;
+}
+
+// NOTE: answers the numbers the loop can without the pool, from the sieve, the small factors and the cache. Returns
+// whether the whole batch was answered
+bool
+prime_batch_resolve(prime_peer_t* peer) {
+    bool resolved = true;
+
+    for (size_t i = 0; i < peer->nnums; i++) {
+        prime_result_t result = prime_quick_check(peer->nums[i]);
+        uint64_t cached;
+
+        if (result == PRIME_UNKNOWN && lru_cache_get(peer->loop->cache, peer->nums[i], &cached)) {
+            result = (prime_result_t) cached;
+        }
+
+        peer->results[i] = result;
+        resolved = resolved && result != PRIME_UNKNOWN;
+    }
+
+    return resolved;
+}
+
+// NOTE: renders the answers of the batch on out, returns the length
+size_t
+prime_batch_answers(const prime_peer_t* peer, char* out) {
+    size_t len = 0;
+
+    for (size_t i = 0; i < peer->nnums; i++) {
+        const char* response = prime_response(peer->results[i] == PRIME_PRIME);
+        size_t response_len = strlen(response);
+
+        memcpy(&out[len], response, response_len);
+        len += response_len;
+    }
+
+    return len;
+}
+
+// NOTE: runs on a compute worker, only the numbers the loop couldn't answer are left
+void
+prime_run_job(compute_job_t* job) {
+    prime_peer_t* peer = (prime_peer_t*) job;
+
+    for (size_t i = 0; i < peer->nnums; i++) {
+        if (peer->results[i] == PRIME_UNKNOWN) {
+            peer->results[i] = prime_miller_rabin(peer->nums[i]) ? PRIME_PRIME : PRIME_COMPOSITE;
+
+            lru_cache_put(peer->loop->cache, peer->nums[i], peer->results[i]);
+        }
+    }
+}
+
+// NOTE: returns false when the loop answered the whole batch, the peer replies right away
+bool
+prime_submit(prime_peer_t* peer, void (*complete)(compute_job_t*)) {
+    log_debug("batch of %lu numbers, first %lu", peer->nnums, peer->nums[0]);
+
+    if (prime_batch_resolve(peer)) {
+        return false;
+    }
+
+    peer->job_inflight = true;
+    peer->job.run = prime_run_job;
+    peer->job.complete = complete;
+
+    compute_pool_submit(peer->loop->compute, &peer->job, &peer->loop->completion);
+
+    return true;
+}
+
+prime_peer_t*
+prime_peer_create(prime_loop_t* loop) {
+    prime_peer_t* peer = (prime_peer_t*) pool_alloc(&loop->peers);
+
+    peer->loop = loop;
+    peer->nums = NULL;
+    peer->results = NULL;
+    peer->nnums = 0;
+    peer->batch_cap = 0;
+    peer->writes_inflight = 0;
+    peer->job_inflight = false;
+    peer->read_closed = false;
+    peer->read_paused = false;
+    peer->closed = false;
+    peer->sockfd = -1;
+    peer->epoll_events = 0;
+
+    prime_parser_init(&peer->parser);
+    send_queue_init(&peer->send_queue);
+
+    stats_add(&stats_current->accepts, 1);
+
+    return peer;
+}
+
+void
+prime_peer_release(prime_peer_t* peer) {
+    free(peer->nums);
+    free(peer->results);
+
+    pool_release(&peer->loop->peers, peer);
+}
+
+// NOTE: the connection is closed, the peer waits for its job if there's one
+void
+prime_peer_closed(prime_peer_t* peer) {
+    peer->closed = true;
+
+    stats_add(&stats_current->closes, 1);
+
+    if (!peer->job_inflight) {
+        prime_peer_release(peer);
+    }
+}
+
+void
+prime_loop_init(prime_loop_t* loop, int nworkers) {
+    loop->compute = compute_pool_create(nworkers);
+    loop->cache = lru_cache_create(PRIME_CACHE_SIZE);
+
+    pool_init(&loop->peers, "prime_peer", sizeof(prime_peer_t), PRIME_POOL_MAX_FREE);
+}
+
+/*
+ * -----
+ * EPOLL
+ * -----
+ */
+
+void
+prime_epoll_set_interest(prime_peer_t* peer) {
+    if (peer->send_queue.len >= send_queue_high_watermark) {
+        peer->read_paused = true;
+    } else if (peer->send_queue.len <= send_queue_low_watermark) {
+        peer->read_paused = false;
+    }
+
+    uint32_t events = (!peer->job_inflight && !peer->read_closed && !peer->read_paused ? EPOLLIN : 0)
+                      | (peer->send_queue.len > 0 ? EPOLLOUT : 0);
+
+    if (peer->epoll_events == events) {
+        return;
+    }
+
+    struct epoll_event event = {0};
+
+    event.data.ptr = peer;
+    event.events = events;
+
+    stats_add(&stats_current->syscalls, 1);
+
+    if (epoll_ctl(peer->loop->epollfd, EPOLL_CTL_MOD, peer->sockfd, &event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    peer->epoll_events = events;
+}
+
+void
+prime_epoll_close(prime_peer_t* peer) {
+    log_info("connection %d closed", peer->sockfd);
+
+    stats_add(&stats_current->syscalls, 1);
+
+    if (epoll_ctl(peer->loop->epollfd, EPOLL_CTL_DEL, peer->sockfd, NULL) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    close(peer->sockfd);
+    send_queue_clear(&peer->send_queue);
+
+    prime_peer_closed(peer);
+}
+
+// NOTE: sends until the queue is empty or the socket is full, returns false when the peer must be closed
+bool
+prime_epoll_flush(prime_peer_t* peer) {
+    while (peer->send_queue.len > 0) {
+        struct iovec iov[SEND_QUEUE_MAX_IOV];
+        struct msghdr msg = {0};
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = send_queue_iov(&peer->send_queue, iov, SEND_QUEUE_MAX_IOV);
+
+        ssize_t sent_len = sendmsg(peer->sockfd, &msg, MSG_NOSIGNAL);
+
+        stats_add(&stats_current->syscalls, 1);
+
+        if (sent_len == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+
+            log_error("%s:%d: error to send data on socket: %s", __FILE__, __LINE__, strerror(errno));
+
+            return false;
+        }
+
+        stats_add(&stats_current->bytes_out, sent_len);
+
+        send_queue_consume(&peer->send_queue, sent_len);
+    }
+
+    return !peer->read_closed || peer->job_inflight;
+}
+
+void
+prime_epoll_queue_answers(prime_peer_t* peer) {
+    size_t len = prime_batch_answers(peer, peer->loop->answers);
+
+    send_queue_append(&peer->send_queue, (const uint8_t*) peer->loop->answers, len);
+}
+
+void
+prime_epoll_on_job_done(compute_job_t* job) {
+    prime_peer_t* peer = (prime_peer_t*) job;
+
+    peer->job_inflight = false;
+
+    if (peer->closed) {
+        prime_peer_release(peer);
+
+        return;
+    }
+
+    prime_epoll_queue_answers(peer);
+
+    if (!prime_epoll_flush(peer)) {
+        prime_epoll_close(peer);
+    } else {
+        prime_epoll_set_interest(peer);
+    }
+}
+
+void
+prime_epoll_on_readable(prime_peer_t* peer) {
+    uint8_t buf[PRIME_RECV_BUF_SIZE];
+    ssize_t len = recv(peer->sockfd, buf, sizeof(buf), 0);
+
+    stats_add(&stats_current->syscalls, 1);
+
+    size_t nnums = 0;
+
+    if (len > 0) {
+        stats_add(&stats_current->bytes_in, len);
+
+        nnums = prime_batch_parse(peer, buf, len);
+    } else if (len == 0) {
+        peer->read_closed = true;
+
+        nnums = prime_batch_finish(peer);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error("%s:%d: error to receive data on socket: %s", __FILE__, __LINE__, strerror(errno));
+
+        prime_epoll_close(peer);
+
+        return;
+    }
+
+    if (nnums > 0 && !prime_submit(peer, prime_epoll_on_job_done)) {
+        prime_epoll_queue_answers(peer);
+
+        if (!prime_epoll_flush(peer)) {
+            prime_epoll_close(peer);
+
+            return;
+        }
+    }
+
+    if (peer->read_closed && !peer->job_inflight && peer->send_queue.len == 0) {
+        prime_epoll_close(peer);
+    } else {
+        prime_epoll_set_interest(peer);
+    }
+}
+
+void
+prime_epoll_on_accept(prime_loop_t* loop, accepted_peer_t* accepted) {
+    log_peer_connection(&accepted->addr, accepted->addr_len);
+
+    prime_peer_t* peer = prime_peer_create(loop);
+
+    peer->sockfd = accepted->sockfd;
+    peer->epoll_events = EPOLLIN;
+
+    struct epoll_event event = {0};
+
+    event.data.ptr = peer;
+    event.events = EPOLLIN;
+
+    stats_add(&stats_current->syscalls, 1);
+
+    if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, peer->sockfd, &event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+}
+
+void
+prime_epoll_server(int sockfd, int nworkers) {
+    prime_loop_t loop;
+
+    prime_loop_init(&loop, nworkers);
+    compute_completion_init_eventfd(&loop.completion);
+
+    stats_register("prime");
+
+    make_sock_nonblocking(sockfd);
+
+    loop.epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop.epollfd == -1) {
+        errlog("error to create epoll queue");
+    }
+
+    // NOTE: the listener and the completion eventfd are told apart from the peers by data.ptr
+    struct epoll_event event = {0};
+
+    event.data.ptr = NULL;
+    event.events = EPOLLIN;
+
+    if (epoll_ctl(loop.epollfd, EPOLL_CTL_ADD, sockfd, &event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    event.data.ptr = &loop.completion;
+
+    if (epoll_ctl(loop.epollfd, EPOLL_CTL_ADD, loop.completion.eventfd, &event) == -1) {
+        errlog("error on epoll queue manipulation");
+    }
+
+    struct epoll_event* events = (struct epoll_event*) calloc(PRIME_MAX_EVENTS, sizeof(struct epoll_event));
+    accepted_peer_t accepted[ACCEPT_BUDGET];
+
+    if (events == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    while (1) {
+        int nready = epoll_wait(loop.epollfd, events, PRIME_MAX_EVENTS, -1);
+
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            errlog("error on epoll_wait");
+        }
+
+        uint64_t started_ns = stats_clock_ns();
+        bool completed = false;
+
+        stats_add(&stats_current->syscalls, 1);
+        stats_hist_add(&stats_current->events_per_wait, nready);
+
+        for (int i = 0; i < nready; i++) {
+            if (events[i].data.ptr == NULL) {
+                bool drained;
+                int naccepted = accept_peers(sockfd, accepted, ACCEPT_BUDGET, &drained);
+
+                for (int k = 0; k < naccepted; k++) {
+                    prime_epoll_on_accept(&loop, &accepted[k]);
+                }
+            } else if (events[i].data.ptr == &loop.completion) {
+                completed = true;
+            } else {
+                prime_peer_t* peer = (prime_peer_t*) events[i].data.ptr;
+
+                // NOTE: reported even while nothing is asked for, the answer can't be delivered anymore
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    prime_epoll_close(peer);
+                } else if (events[i].events & EPOLLOUT && !prime_epoll_flush(peer)) {
+                    prime_epoll_close(peer);
+                } else if (events[i].events & EPOLLIN) {
+                    prime_epoll_on_readable(peer);
+                } else {
+                    prime_epoll_set_interest(peer);
+                }
+            }
+        }
+
+        // NOTE: after the peer events, a job may close and release a peer that still had an event on this batch
+        if (completed) {
+            stats_add(&stats_current->syscalls, 1);
+
+            compute_completion_drain(&loop.completion);
+        }
+
+        stats_loop_iteration(started_ns);
+    }
+}
+
+/*
+ * -----
+ * LIBUV
+ * -----
+ */
+
+void
+prime_uv_on_closed(uv_handle_t* handle) {
+    prime_peer_closed((prime_peer_t*) handle->data);
+}
+
+void
+prime_uv_close(prime_peer_t* peer) {
+    if (!uv_is_closing((uv_handle_t*) &peer->client)) {
+        log_info("connection %p closed", (void*) peer);
+
+        uv_close((uv_handle_t*) &peer->client, prime_uv_on_closed);
+    }
+}
+
+void
+prime_uv_on_alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    UNUSED(suggested_size);
+
+    prime_peer_t* peer = (prime_peer_t*) handle->data;
+
+    buf->base = peer->loop->read_buf;
+    buf->len = PRIME_RECV_BUF_SIZE;
+}
+
+// NOTE: a peer that finished sending is closed once its last answer is written
+bool
+prime_uv_is_done(const prime_peer_t* peer) {
+    return peer->read_closed && !peer->job_inflight && peer->writes_inflight == 0;
+}
+
+void prime_uv_on_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf);
+
+// NOTE: reads again unless a job is in flight, the peer finished sending or its answers are still piled up
+void
+prime_uv_resume(prime_peer_t* peer) {
+    if (peer->job_inflight || peer->read_closed || peer->read_paused) {
+        return;
+    }
+
+    int rc;
+
+    if ((rc = uv_read_start((uv_stream_t*) &peer->client, prime_uv_on_alloc_buffer, prime_uv_on_read)) < 0) {
+        errlog("libuv error to read connection: %s", uv_strerror(rc));
+    }
+}
+
+void
+prime_uv_on_written(uv_write_t* req, int status) {
+    prime_uv_write_t* write = (prime_uv_write_t*) req;
+    prime_peer_t* peer = write->peer;
+
+    free(write);
+
+    peer->writes_inflight--;
+
+    // NOTE: the pending writes are canceled when the handle closes
+    if (status == UV_ECANCELED) {
+        return;
+    }
+
+    if (status < 0) {
+        log_error("%s:%d: libuv error to write on connection: %s", __FILE__, __LINE__, uv_strerror(status));
+    }
+
+    if (status < 0 || prime_uv_is_done(peer)) {
+        prime_uv_close(peer);
+    } else if (peer->read_paused
+               && uv_stream_get_write_queue_size((uv_stream_t*) &peer->client) <= send_queue_low_watermark) {
+        peer->read_paused = false;
+
+        prime_uv_resume(peer);
+    }
+}
+
+void
+prime_uv_write_answers(prime_peer_t* peer) {
+    prime_uv_write_t* write = (prime_uv_write_t*) malloc(sizeof(prime_uv_write_t) + peer->nnums * PRIME_ANSWER_MAX_LEN);
+
+    if (write == NULL) {
+        errlog("error to allocate memory");
+    }
+
+    write->peer = peer;
+
+    uv_buf_t write_buf = uv_buf_init(write->answers, prime_batch_answers(peer, write->answers));
+
+    int rc;
+
+    if ((rc = uv_write(&write->req, (uv_stream_t*) &peer->client, &write_buf, 1, prime_uv_on_written)) < 0) {
+        errlog("libuv error to write: %s", uv_strerror(rc));
+    }
+
+    peer->writes_inflight++;
+
+    stats_add(&stats_current->bytes_out, write_buf.len);
+
+    // NOTE: what the socket didn't take right away waits on the write queue, resumed in prime_uv_on_written
+    if (uv_stream_get_write_queue_size((uv_stream_t*) &peer->client) >= send_queue_high_watermark) {
+        peer->read_paused = true;
+
+        uv_read_stop((uv_stream_t*) &peer->client);
+    }
+}
+
+void prime_uv_on_job_done(compute_job_t* job);
+
+void
+prime_uv_on_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf) {
+    prime_peer_t* peer = (prime_peer_t*) client->data;
+    size_t nnums = 0;
+
+    if (nread > 0) {
+        stats_add(&stats_current->bytes_in, nread);
+
+        nnums = prime_batch_parse(peer, (const uint8_t*) buf->base, nread);
+    } else if (nread == UV_EOF) {
+        uv_read_stop(client);
+
+        peer->read_closed = true;
+
+        nnums = prime_batch_finish(peer);
+    } else if (nread < 0) {
+        log_error("libuv error reading connection: %s", uv_strerror(nread));
+
+        prime_uv_close(peer);
+
+        return;
+    }
+
+    if (nnums > 0) {
+        if (prime_submit(peer, prime_uv_on_job_done)) {
+            // NOTE: resumed once the job is back
+            uv_read_stop(client);
+        } else {
+            prime_uv_write_answers(peer);
+        }
+    } else if (prime_uv_is_done(peer)) {
+        prime_uv_close(peer);
+    }
+}
+
+void
+prime_uv_on_job_done(compute_job_t* job) {
+    prime_peer_t* peer = (prime_peer_t*) job;
+
+    peer->job_inflight = false;
+
+    if (peer->closed) {
+        prime_peer_release(peer);
+
+        return;
+    }
+
+    if (uv_is_closing((uv_handle_t*) &peer->client)) {
+        return;
+    }
+
+    prime_uv_write_answers(peer);
+    prime_uv_resume(peer);
+}
+
+void
+prime_uv_on_connected(uv_stream_t* server_stream, int status) {
+    if (status < 0) {
+        log_error("%s:%d: peer connection error: %s", __FILE__, __LINE__, uv_strerror(status));
+
+        return;
+    }
+
+    prime_loop_t* loop = (prime_loop_t*) server_stream->data;
+    prime_peer_t* peer = prime_peer_create(loop);
+
+    int rc;
+
+    if ((rc = uv_tcp_init(loop->uv_loop, &peer->client)) < 0) {
+        errlog("libuv client connection failed: %s", uv_strerror(rc));
+    }
+
+    peer->client.data = peer;
+
+    if (uv_accept(server_stream, (uv_stream_t*) &peer->client) != 0) {
+        prime_uv_close(peer);
+
+        return;
+    }
+
+    struct sockaddr_storage peername;
+    int namelen = sizeof(peername);
+
+    if (uv_tcp_getpeername(&peer->client, (struct sockaddr*) &peername, &namelen) == 0) {
+        log_peer_connection((const struct sockaddr_in*) &peername, namelen);
+    }
+
+    if ((rc = uv_read_start((uv_stream_t*) &peer->client, prime_uv_on_alloc_buffer, prime_uv_on_read)) < 0) {
+        errlog("libuv error to read connection: %s", uv_strerror(rc));
+    }
+}
+
+// NOTE: called from the compute workers, uv_async_send is the only thread-safe call of libuv
+void
+prime_uv_notify(compute_completion_t* completion) {
+    uv_async_send((uv_async_t*) completion->data);
+}
+
+void
+prime_uv_on_completion(uv_async_t* handle) {
+    prime_loop_t* loop = (prime_loop_t*) handle->data;
+
+    compute_completion_drain(&loop->completion);
+}
+
+int
+prime_libuv_server(int port, int nworkers) {
+    prime_loop_t loop;
+    uv_tcp_t server_stream;
+
+    prime_loop_init(&loop, nworkers);
+    compute_completion_init(&loop.completion, prime_uv_notify, &loop.completion_handle);
+
+    stats_register("prime_libuv");
+
+    loop.uv_loop = uv_default_loop();
+    loop.completion_handle.data = &loop;
+    server_stream.data = &loop;
+
+    int rc;
+
+    if ((rc = uv_async_init(loop.uv_loop, &loop.completion_handle, prime_uv_on_completion)) < 0) {
+        errlog("libuv error to initialize async handle: %s", uv_strerror(rc));
+    }
+
+    if ((rc = uv_tcp_init(loop.uv_loop, &server_stream)) < 0) {
+        errlog("libuv tcp connection initialization failed: %s", uv_strerror(rc));
+    }
+
+    if ((rc = uv_tcp_open(&server_stream, listen_inet_socket(port, false))) < 0) {
+        errlog("libuv error to open the listening socket: %s", uv_strerror(rc));
+    }
+
+    if ((rc = uv_listen((uv_stream_t*) &server_stream, listen_backlog, prime_uv_on_connected)) < 0) {
+        errlog("libuv error to listen: %s", uv_strerror(rc));
+    }
+
+    return uv_run(loop.uv_loop, UV_RUN_DEFAULT);
+}
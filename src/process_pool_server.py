@@ -0,0 +1,232 @@
+#!/usr/bin/env python3.8
+
+# NOTE: prefork server, the GIL serializes the threads of thread_pool_server.py no matter how many there are. Every
+# worker process runs a selector loop on a listening socket of its own, all bound to the same port with SO_REUSEPORT
+# so the kernel spreads the connections between them and the workers share nothing
+
+import argparse
+import os
+import selectors
+import signal
+import socket
+import sys
+import time
+
+from thread_pool_server import ProcessState, transform
+
+RECV_BUF_SIZE = 16 * 1024
+# NOTE: a peer isn't read while this much of its output is waiting, like the send queue watermark of the C servers
+OUTBUF_HIGH_WATERMARK = 256 * 1024
+# NOTE: a worker dying sooner than this after its start is respawned later and later, up to RESPAWN_MAX_DELAY, like
+# the worker pool of index.js, so a worker failing at startup doesn't fork in a tight loop
+RESPAWN_MIN_UPTIME = 1.0
+RESPAWN_MAX_DELAY = 1.0
+
+
+class Peer:
+    def __init__(self, sockobj, client_addr):
+        self.sockobj = sockobj
+        self.client_addr = client_addr
+        self.state = ProcessState.WAITTING
+        # NOTE: output the socket didn't take yet, starts with the '*' ack
+        self.outbuf = bytearray(b'*')
+        # NOTE: the events registered on the selector, modify is only called when they change
+        self.events = selectors.EVENT_READ
+        # NOTE: the peer finished sending, it's closed once the output is flushed
+        self.read_closed = False
+
+
+def listen_socket(host, port, backlog):
+    sockobj = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sockobj.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sockobj.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+    sockobj.bind((host, port))
+    sockobj.listen(backlog)
+    sockobj.setblocking(False)
+
+    return sockobj
+
+
+def update_interest(selector, peer):
+    events = selectors.EVENT_WRITE if peer.outbuf else 0
+
+    if len(peer.outbuf) < OUTBUF_HIGH_WATERMARK and not peer.read_closed:
+        events |= selectors.EVENT_READ
+
+    if events != peer.events:
+        selector.modify(peer.sockobj, events, peer)
+
+        peer.events = events
+
+
+def close_peer(selector, peer):
+    print('{} done'.format(peer.client_addr))
+
+    selector.unregister(peer.sockobj)
+    peer.sockobj.close()
+
+
+# NOTE: returns False when the peer must be closed
+def flush_peer(peer):
+    try:
+        sent = peer.sockobj.send(peer.outbuf)
+    except BlockingIOError:
+        return True
+    except IOError:
+        return False
+
+    del peer.outbuf[:sent]
+
+    return True
+
+
+# NOTE: the transformed chunk is queued as a whole and sent right away, what the socket doesn't take waits for
+# EVENT_WRITE
+def on_peer_readable(selector, peer):
+    try:
+        buf = peer.sockobj.recv(RECV_BUF_SIZE)
+    except BlockingIOError:
+        return
+    except IOError:
+        close_peer(selector, peer)
+
+        return
+
+    if not buf:
+        peer.read_closed = True
+
+        if peer.outbuf:
+            update_interest(selector, peer)
+        else:
+            close_peer(selector, peer)
+
+        return
+
+    peer.state, out = transform(peer.state, buf)
+    peer.outbuf += out
+
+    if peer.outbuf and not flush_peer(peer):
+        close_peer(selector, peer)
+    else:
+        update_interest(selector, peer)
+
+
+def on_accept(selector, listener):
+    while True:
+        try:
+            sockobj, client_addr = listener.accept()
+        except BlockingIOError:
+            return
+        except OSError as e:
+            # NOTE: out of fds, the rest waits on the backlog
+            print('err: accept: {}'.format(e), file=sys.stderr)
+
+            return
+
+        print('{} connected (worker {})'.format(client_addr, os.getpid()))
+
+        sockobj.setblocking(False)
+        sockobj.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+        peer = Peer(sockobj, client_addr)
+
+        selector.register(sockobj, selectors.EVENT_READ, peer)
+
+        if not flush_peer(peer):
+            close_peer(selector, peer)
+        else:
+            update_interest(selector, peer)
+
+
+def serve(host, port, backlog):
+    listener = listen_socket(host, port, backlog)
+    selector = selectors.DefaultSelector()
+
+    selector.register(listener, selectors.EVENT_READ, None)
+
+    while True:
+        for key, mask in selector.select():
+            if key.data is None:
+                on_accept(selector, listener)
+                continue
+
+            peer = key.data
+
+            if mask & selectors.EVENT_WRITE and peer.outbuf:
+                if not flush_peer(peer) or (peer.read_closed and not peer.outbuf):
+                    close_peer(selector, peer)
+                    continue
+
+            if mask & selectors.EVENT_READ:
+                on_peer_readable(selector, peer)
+            else:
+                update_interest(selector, peer)
+
+
+def start_worker(host, port, backlog):
+    pid = os.fork()
+
+    if pid != 0:
+        return pid
+
+    # NOTE: the parent handles the interrupt and stops the workers
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    signal.signal(signal.SIGTERM, signal.SIG_DFL)
+    sys.stdout.reconfigure(line_buffering=True)
+
+    try:
+        serve(host, port, backlog)
+    finally:
+        os._exit(1)
+
+
+def main():
+    argparser = argparse.ArgumentParser('Process Pool Server')
+
+    argparser.add_argument('host', help='server host name')
+    argparser.add_argument('port', type=int, help='server port')
+    argparser.add_argument('-n', type=int, default=os.cpu_count(), help='number of worker processes')
+    argparser.add_argument('-b', type=int, default=64, help='listen backlog of each worker')
+
+    args = argparser.parse_args()
+
+    # NOTE: a SIGTERM stops the workers too, like an interrupt
+    signal.signal(signal.SIGTERM, signal.default_int_handler)
+
+    # NOTE: pid -> start time of the worker
+    workers = {start_worker(args.host, args.port, args.b): time.monotonic() for _ in range(args.n)}
+    respawn_delay = 0
+
+    print('{} workers listening on {}:{}'.format(len(workers), args.host, args.port))
+    sys.stdout.flush()
+
+    try:
+        # NOTE: a worker that died is replaced, the others keep serving meanwhile
+        while True:
+            pid, status = os.wait()
+
+            started = workers.pop(pid, None)
+
+            print('err: worker {} exited with status {}'.format(pid, status), file=sys.stderr)
+
+            if started is not None and time.monotonic() - started < RESPAWN_MIN_UPTIME:
+                respawn_delay = min(respawn_delay * 2 or 0.01, RESPAWN_MAX_DELAY)
+            else:
+                respawn_delay = 0
+
+            time.sleep(respawn_delay)
+
+            workers[start_worker(args.host, args.port, args.b)] = time.monotonic()
+    except KeyboardInterrupt as e:
+        print('err: {}'.format(e))
+
+        for pid in workers:
+            # NOTE: an interrupt right after os.wait() leaves a reaped worker in the table
+            try:
+                os.kill(pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+
+
+if __name__ == '__main__':
+    main()
@@ -10,6 +10,8 @@
 
 void
 sequential_server(int sockfd) {
+    stats_register("sequential");
+
     while (1) {
         struct sockaddr_in peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
@@ -23,6 +25,6 @@ sequential_server(int sockfd) {
         log_peer_connection(&peer_addr, peer_addr_len);
         start_state_machine(sockfd_new);
 
-        printf("peer done\n");
+        log_info("peer done");
     }
 }
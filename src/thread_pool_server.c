@@ -0,0 +1,146 @@
+// NOTE: a fixed set of workers pull accepted connections from a bounded queue, so memory is predictable and no thread
+// is created per connection. When every slot of the queue is taken the acceptor blocks, leaving new peers waiting in
+// the kernel listen backlog (backpressure) instead of growing the process
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "headers/error.h"
+#include "headers/servers.h"
+#include "headers/state_machine.h"
+
+#define CONN_QUEUE_SIZE 256
+#define POOL_THREAD_STACK_SIZE 256 * 1024
+
+typedef struct {
+    int sockfds[CONN_QUEUE_SIZE];
+    int head;
+    int tail;
+    int len;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} conn_queue_t;
+
+void
+conn_queue_init(conn_queue_t* queue) {
+    queue->head = 0;
+    queue->tail = 0;
+    queue->len = 0;
+
+    if (pthread_mutex_init(&queue->lock, NULL) != 0) {
+        errlog("error to initialize connection queue lock");
+    }
+
+    if (pthread_cond_init(&queue->not_empty, NULL) != 0 || pthread_cond_init(&queue->not_full, NULL) != 0) {
+        errlog("error to initialize connection queue conditions");
+    }
+}
+
+// NOTE: blocks the producer while the queue is full
+void
+conn_queue_push(conn_queue_t* queue, int sockfd) {
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->len == CONN_QUEUE_SIZE) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+
+    queue->sockfds[queue->tail] = sockfd;
+    queue->tail = (queue->tail + 1) % CONN_QUEUE_SIZE;
+    queue->len++;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int
+conn_queue_pop(conn_queue_t* queue) {
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->len == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    int sockfd = queue->sockfds[queue->head];
+
+    queue->head = (queue->head + 1) % CONN_QUEUE_SIZE;
+    queue->len--;
+
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return sockfd;
+}
+
+void*
+start_pool_worker(void* arg) {
+    conn_queue_t* queue = (conn_queue_t*) arg;
+
+    unsigned long id = (unsigned long) pthread_self();
+
+    stats_register("worker");
+
+    while (1) {
+        int sockfd = conn_queue_pop(queue);
+
+        log_info("worker %lu handling connection with socket %d", id, sockfd);
+
+        start_state_machine(sockfd);
+
+        log_info("worker %lu done with socket %d", id, sockfd);
+    }
+
+    return 0;
+}
+
+void
+thread_pool_server(int sockfd, int nthreads) {
+    if (nthreads <= 0) {
+        errlog("thread pool needs at least one worker, got %d", nthreads);
+    }
+
+    conn_queue_t queue;
+
+    conn_queue_init(&queue);
+
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+
+    // NOTE: the state machine only keeps a small recv buffer on the stack, the default 8 MB is wasted here
+    if (pthread_attr_setstacksize(&attr, POOL_THREAD_STACK_SIZE) != 0) {
+        errlog("error to set worker stack size");
+    }
+
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t worker_thread;
+
+        if (pthread_create(&worker_thread, &attr, start_pool_worker, &queue) != 0) {
+            errlog("error to create pool worker %d", i);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    while (1) {
+        struct sockaddr_in peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+
+        int sockfd_new = accept(sockfd, (struct sockaddr*) &peer_addr, &peer_addr_len);
+
+        if (sockfd_new < 0) {
+            errlog("error to accept socket connection");
+        }
+
+        log_peer_connection(&peer_addr, peer_addr_len);
+
+        conn_queue_push(&queue, sockfd_new);
+    }
+}
@@ -10,6 +10,39 @@ class ProcessState(enum.Enum):
     WAITTING = 0
     PROCESSING = 1
 
+# NOTE: every byte X between '^' and '$' goes out as (X + 1), wrapping like the C servers
+SHIFT_TABLE = bytes((b + 1) % 256 for b in range(256))
+
+# NOTE: runs the state machine over a whole chunk and returns the new state and the output of the chunk. The
+# delimiters are searched with bytes.find and the spans in between shifted with bytes.translate, so the work per byte
+# runs in C instead of the interpreter loop
+def transform(state, buf):
+    out = []
+    i = 0
+
+    while i < len(buf):
+        if state == ProcessState.WAITTING:
+            caret = buf.find(b'^', i)
+
+            if caret == -1:
+                break
+
+            state = ProcessState.PROCESSING
+            i = caret + 1
+        else:
+            dollar = buf.find(b'$', i)
+            end = len(buf) if dollar == -1 else dollar
+
+            out.append(buf[i:end].translate(SHIFT_TABLE))
+
+            if dollar == -1:
+                break
+
+            state = ProcessState.WAITTING
+            i = dollar + 1
+
+    return state, b''.join(out)
+
 def start_new_connection(sockobj, client_addr):
     print('{} connected'.format(client_addr))
 
@@ -26,22 +59,19 @@ def start_new_connection(sockobj, client_addr):
         except IOError as e:
             break
 
-        for b in buf:
-            if state == ProcessState.WAITTING:
-                if b == ord(b'^'):
-                    state = ProcessState.PROCESSING
-            elif state == ProcessState.PROCESSING:
-                if b == ord(b'$'):
-                    state = ProcessState.WAITTING
-                else:
-                    sockobj.send(bytes([b + 1]))
-            else:
-                assert False
+        # NOTE: the whole transformed chunk goes out at once instead of one send per byte
+        state, out = transform(state, buf)
+
+        if out:
+            try:
+                sockobj.sendall(out)
+            except IOError as e:
+                break
 
     print('{} done'.format(client_addr))
 
     sys.stdout.flush()
-    sobkobj.close()
+    sockobj.close()
 
 
 def main():
@@ -1,11 +1,7 @@
+const { parentPort } = require('worker_threads');
 const { isPrime } = require('./utils');
 
-process.on('message', message => {
-   console.log('[child %d] received msg from server:', process.pid, message);
-
-   process.send({ task: message, result: isPrime(message, true) });
-   process.disconnect();
-
-   console.log('[child %d] exiting', process.pid);
-   process.exit();
+// NOTE: a long-lived worker of the pool on index.js, it answers one job at a time for as long as the server runs
+parentPort.on('message', ({ id, num }) => {
+   parentPort.postMessage({ id, result: isPrime(num, true) });
 });